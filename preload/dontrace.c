@@ -0,0 +1,313 @@
+/*
+  Preloaded into processes started by exec with trace:true. Appends a line to the file named by
+  DON_TRACE for each file the process opens, stats or executes: 'r' if it was read or looked for,
+  'w' if it was opened for writing, followed by the absolute path. Each line is written with a
+  single write to a file opened for appending, so that lines of processes running at the same
+  time don't interleave. The file is opened for each line instead of once, since a child started
+  with vfork shares the memory of its parent, but not its file descriptors.
+*/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NEW_STAT (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+
+typedef int (*OpenFunction)(const char*, int, ...);
+typedef int (*OpenAtFunction)(int, const char*, int, ...);
+typedef FILE *(*FopenFunction)(const char*, const char*);
+typedef int (*ExecveFunction)(const char*, char *const[], char *const[]);
+
+static OpenFunction realOpen;
+
+
+static void *findReal(const char *name)
+{
+    return dlsym(RTLD_NEXT, name);
+}
+
+static int openTrace(void)
+{
+    const char *path = getenv("DON_TRACE");
+    if (!path || !*path)
+    {
+        return -1;
+    }
+    if (!realOpen)
+    {
+        realOpen = (OpenFunction)findReal("open");
+    }
+    return realOpen(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+}
+
+/* Writes the directory dirfd refers to into buffer, and returns its length, or 0 on errors. */
+static size_t getDirectory(int dirfd, char *buffer, size_t size)
+{
+    char link[32];
+    ssize_t length;
+
+    if (dirfd == AT_FDCWD)
+    {
+        return getcwd(buffer, size) ? strlen(buffer) : 0;
+    }
+    sprintf(link, "/proc/self/fd/%d", dirfd);
+    length = readlink(link, buffer, size);
+    return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+static void record(int dirfd, const char *path, char mode)
+{
+    char buffer[PATH_MAX * 2 + 3];
+    size_t length = 1;
+    size_t pathLength;
+    int savedErrno = errno;
+    int fd;
+
+    if (!path || !*path)
+    {
+        return;
+    }
+    buffer[0] = mode;
+    if (*path != '/')
+    {
+        length += getDirectory(dirfd, buffer + 1, PATH_MAX);
+        if (length == 1)
+        {
+            errno = savedErrno;
+            return;
+        }
+        buffer[length++] = '/';
+    }
+    pathLength = strlen(path);
+    if (pathLength > PATH_MAX)
+    {
+        errno = savedErrno;
+        return;
+    }
+    memcpy(buffer + length, path, pathLength);
+    length += pathLength;
+    buffer[length++] = '\n';
+    fd = openTrace();
+    if (fd >= 0)
+    {
+        if (write(fd, buffer, length)) {}
+        close(fd);
+    }
+    errno = savedErrno;
+}
+
+/* Records a file opened with flags. Directories are not recorded, since their status changes
+   whenever a file in them is added or removed. */
+static void recordOpen(int dirfd, const char *path, int flags, int fd)
+{
+    struct stat s;
+
+    if (fd < 0 ? errno != ENOENT : (flags & O_DIRECTORY) != 0)
+    {
+        return;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)))
+    {
+        record(dirfd, path, 'w');
+    }
+    else if (fd < 0 || (!fstat(fd, &s) && !S_ISDIR(s.st_mode)))
+    {
+        record(dirfd, path, 'r');
+    }
+}
+
+static void recordStat(const char *path, int status, const struct stat *s)
+{
+    if (status ? errno == ENOENT : !S_ISDIR(s->st_mode))
+    {
+        record(AT_FDCWD, path, 'r');
+    }
+}
+
+static int openMode(int flags, va_list args)
+{
+    return flags & (O_CREAT | O_TMPFILE) ? va_arg(args, int) : 0;
+}
+
+
+int open(const char *path, int flags, ...)
+{
+    va_list args;
+    int mode;
+    int fd;
+
+    va_start(args, flags);
+    mode = openMode(flags, args);
+    va_end(args);
+    if (!realOpen)
+    {
+        realOpen = (OpenFunction)findReal("open");
+    }
+    fd = realOpen(path, flags, mode);
+    recordOpen(AT_FDCWD, path, flags, fd);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...)
+{
+    static OpenFunction real;
+    va_list args;
+    int mode;
+    int fd;
+
+    va_start(args, flags);
+    mode = openMode(flags, args);
+    va_end(args);
+    if (!real)
+    {
+        real = (OpenFunction)findReal("open64");
+    }
+    fd = real(path, flags, mode);
+    recordOpen(AT_FDCWD, path, flags, fd);
+    return fd;
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    static OpenAtFunction real;
+    va_list args;
+    int mode;
+    int fd;
+
+    va_start(args, flags);
+    mode = openMode(flags, args);
+    va_end(args);
+    if (!real)
+    {
+        real = (OpenAtFunction)findReal("openat");
+    }
+    fd = real(dirfd, path, flags, mode);
+    recordOpen(dirfd, path, flags, fd);
+    return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    static OpenAtFunction real;
+    va_list args;
+    int mode;
+    int fd;
+
+    va_start(args, flags);
+    mode = openMode(flags, args);
+    va_end(args);
+    if (!real)
+    {
+        real = (OpenAtFunction)findReal("openat64");
+    }
+    fd = real(dirfd, path, flags, mode);
+    recordOpen(dirfd, path, flags, fd);
+    return fd;
+}
+
+int creat(const char *path, mode_t mode)
+{
+    return open(path, O_CREAT | O_WRONLY | O_TRUNC, (int)mode);
+}
+
+/* fopen opens files without going through open. */
+static FILE *tracedFopen(const char *name, FopenFunction *real, const char *path,
+                         const char *mode)
+{
+    FILE *file;
+    int flags;
+
+    if (!*real)
+    {
+        *real = (FopenFunction)findReal(name);
+    }
+    file = (*real)(path, mode);
+    flags = *mode == 'r' && !strchr(mode, '+') ? O_RDONLY : O_WRONLY;
+    recordOpen(AT_FDCWD, path, flags, file ? fileno(file) : -1);
+    return file;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+    static FopenFunction real;
+    return tracedFopen("fopen", &real, path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+    static FopenFunction real;
+    return tracedFopen("fopen64", &real, path, mode);
+}
+
+#if NEW_STAT
+int stat(const char *path, struct stat *buf)
+{
+    static int (*real)(const char*, struct stat*);
+    int status;
+    if (!real)
+    {
+        real = (int (*)(const char*, struct stat*))findReal("stat");
+    }
+    status = real(path, buf);
+    recordStat(path, status, buf);
+    return status;
+}
+
+int lstat(const char *path, struct stat *buf)
+{
+    static int (*real)(const char*, struct stat*);
+    int status;
+    if (!real)
+    {
+        real = (int (*)(const char*, struct stat*))findReal("lstat");
+    }
+    status = real(path, buf);
+    recordStat(path, status, buf);
+    return status;
+}
+#else
+/* Before glibc 2.33, stat is an inline function calling __xstat. */
+int __xstat(int version, const char *path, struct stat *buf)
+{
+    static int (*real)(int, const char*, struct stat*);
+    int status;
+    if (!real)
+    {
+        real = (int (*)(int, const char*, struct stat*))findReal("__xstat");
+    }
+    status = real(version, path, buf);
+    recordStat(path, status, buf);
+    return status;
+}
+
+int __lxstat(int version, const char *path, struct stat *buf)
+{
+    static int (*real)(int, const char*, struct stat*);
+    int status;
+    if (!real)
+    {
+        real = (int (*)(int, const char*, struct stat*))findReal("__lxstat");
+    }
+    status = real(version, path, buf);
+    recordStat(path, status, buf);
+    return status;
+}
+#endif
+
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+    static ExecveFunction real;
+    if (!real)
+    {
+        real = (ExecveFunction)findReal("execve");
+    }
+    record(AT_FDCWD, path, 'r');
+    return real(path, argv, envp);
+}
@@ -14,6 +14,7 @@
 #include "fail.h"
 #include "file.h"
 #include "hash.h"
+#include "intvector.h"
 #include "log.h"
 #include "util.h"
 #include "value.h"
@@ -24,7 +25,7 @@
 #define CACHE_DIGEST_SIZE 30
 #define CACHE_FILENAME_LENGTH (CACHE_DIGEST_SIZE / 5 * 8)
 
-#define TAG 0x646f6e00
+#define TAG 0x646f6e01
 
 /*
   The layout of this struct results in simple verification of compatibility.
@@ -59,6 +60,7 @@ typedef struct
     uint dependencyCount;
     uint outLength;
     uint dataLength;
+    uint duration; /* ms */
     Dependency dependencies[1]; /* dependencyCount number of entries */
     /* paths for dependencies */
     /* data[dataLength] */
@@ -414,7 +416,13 @@ void CacheDispose(void)
     free(cacheDir);
 }
 
-void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *path, vref *out)
+bool CacheContainsPath(const char *path, size_t length)
+{
+    return length > cacheDirLength && !memcmp(path, cacheDir, cacheDirLength);
+}
+
+void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *path, vref *out,
+              vref *dependencies, ulong *duration)
 {
     const char *p;
     const Entry *entry;
@@ -432,6 +440,11 @@ void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *pat
     data[cacheDirLength + 2] = '/';
     assert(strlen(data) == pathLength);
     *out = VNull;
+    *duration = 0;
+    if (dependencies)
+    {
+        *dependencies = VEmptyList;
+    }
 
     for (i = tableIndex(hash);; i = (i + 1) & tableMask)
     {
@@ -444,6 +457,7 @@ void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *pat
         if (!memcmp(table[i].hash, hash, CACHE_DIGEST_SIZE))
         {
             entry = getEntry(table[i].entry - 1);
+            *duration = entry->duration;
             break;
         }
     }
@@ -462,6 +476,22 @@ void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *pat
         p += length;
     }
 
+    if (dependencies && entry->dependencyCount)
+    {
+        intvector files;
+        IVInit(&files, entry->dependencyCount);
+        p = (const char*)entry + offsetof(Entry, dependencies) +
+            entry->dependencyCount * sizeof(*entry->dependencies);
+        for (i = 0; i < entry->dependencyCount; i++)
+        {
+            uint length = entry->dependencies[i].pathLength;
+            IVAdd(&files, intFromRef(VCreatePathUnchecked(VCreateString(p, length))));
+            p += length;
+        }
+        *dependencies = VCreateArrayFromVector(&files);
+        IVDispose(&files);
+    }
+
     *uptodate = true;
     *out = VCreateString(p, entry->dataLength);
     p += entry->dataLength;
@@ -485,7 +515,7 @@ static void appendString(vref value)
 }
 
 void CacheSetUptodate(const char *path, size_t pathLength, vref dependencies,
-                      vref output, vref data)
+                      vref output, vref data, ulong duration)
 {
     Entry *entry;
     uint dependencyCount = (uint)VCollectionSize(dependencies);
@@ -530,6 +560,7 @@ void CacheSetUptodate(const char *path, size_t pathLength, vref dependencies,
     entry->dependencyCount = dependencyCount;
     entry->dataLength = (uint)VStringLength(data);
     entry->outLength = (uint)VStringLength(output);
+    entry->duration = (uint)min(duration, UINT_MAX);
     for (i = 0; i < dependencyCount; i++)
     {
         vref value;
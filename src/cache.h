@@ -1,6 +1,18 @@
 void CacheInit(const char *cacheDirectory, size_t cacheDirectoryLength,
                bool cacheDirectoryDotCache);
 void CacheDispose(void);
-void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *path, vref *out);
+
+/*
+  Returns true if path is inside the cache directory.
+*/
+nonnull bool CacheContainsPath(const char *path, size_t length);
+
+/*
+  If dependencies isn't null, it is set to the files an up to date cache entry depends on.
+  duration is set to the time (ms) recorded for the step when the entry was last written, also if
+  the entry is out of date, or 0 if there is no entry.
+*/
+void CacheGet(const byte *hash, bool echoCachedOutput, bool *uptodate, vref *path, vref *out,
+              vref *dependencies, ulong *duration);
 void CacheSetUptodate(const char *path, size_t pathLength,
-                      vref dependencies, vref output, vref data);
+                      vref dependencies, vref output, vref data, ulong duration);
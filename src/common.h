@@ -20,7 +20,9 @@ typedef unsigned long int ulong;
 typedef unsigned char byte;
 
 #define null NULL
+#ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)-1)
+#endif
 
 #define attrprintf(formatarg, args) __attribute((format(printf, formatarg, args)))
 #define nonnull __attribute((nonnull))
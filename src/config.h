@@ -11,11 +11,23 @@
 #ifndef LITTLE_ENDIAN
 #define LITTLE_ENDIAN
 #endif
+#define HAVE_EPOLL 1
+#define HAVE_MEMFD 1
 #define HAVE_MEMRCHR 1
 #define HAVE_OPENAT 1
+#define HAVE_PIDFD 1
 #define HAVE_PIPE2 1
 #define HAVE_POSIX_SPAWN 1
+#define HAVE_PTHREAD 1
+#define HAVE_SPLICE 1
+#ifndef HAVE_VFORK
 #define HAVE_VFORK 1
+#endif
+
+/* Start processes from a small helper process forked at startup. */
+#ifndef USE_SPAWN_HELPER
+#define USE_SPAWN_HELPER 1
+#endif
 
 #if HAVE_VFORK
 #define VFORK vfork
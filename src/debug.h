@@ -4,6 +4,9 @@
 #ifndef DEBUG_FUTURE
 #define DEBUG_FUTURE 0
 #endif
+#ifndef DEBUG_INSTRUCTIONS
+#define DEBUG_INSTRUCTIONS 0 /* Print instructions executed per second on exit. */
+#endif
 #ifndef DEBUG_JOB
 #define DEBUG_JOB 0
 #endif
@@ -13,6 +16,9 @@
 #ifndef DEBUG_PARSER
 #define DEBUG_PARSER 0
 #endif
+#ifndef DEBUG_SPAWN
+#define DEBUG_SPAWN 0 /* Print process start to exit latencies on exit. */
+#endif
 #ifndef DEBUG_TRACE
 #define DEBUG_TRACE 0
 #endif
@@ -2,11 +2,13 @@
 #include <stdarg.h>
 #include <string.h>
 #include "common.h"
+#include "bytevector.h"
 #include "env.h"
 #include "value.h"
 
 static const char **env;
 static size_t envCount;
+static bytevector ownedEntries; /* char* of entries added by EnvSet */
 
 void EnvInit(char **environ)
 {
@@ -27,10 +29,17 @@ void EnvInit(char **environ)
     }
     envCount = (size_t)(dst - env);
     *dst = null;
+    BVInit(&ownedEntries, sizeof(char*));
 }
 
 void EnvDispose(void)
 {
+    size_t i;
+    for (i = 0; i < BVSize(&ownedEntries); i += sizeof(char*))
+    {
+        free(*(char**)BVGetWritePointer(&ownedEntries, i));
+    }
+    BVDispose(&ownedEntries);
     free(env);
 }
 
@@ -63,6 +72,28 @@ void EnvGet(const char *name, size_t length,
     }
 }
 
+void EnvSet(const char *name, const char *value)
+{
+    size_t length = strlen(name);
+    size_t valueLength = strlen(value);
+    char *entry = (char*)malloc(length + valueLength + 2);
+    const char **p;
+
+    memcpy(entry, name, length);
+    entry[length] = '=';
+    memcpy(entry + length + 1, value, valueLength + 1);
+    BVAddData(&ownedEntries, (const byte*)&entry, sizeof(entry));
+
+    p = getEnvEntry(env, name, length);
+    if (!*p)
+    {
+        env = (const char**)realloc(env, (envCount + 2) * sizeof(char*));
+        p = env + envCount++;
+        p[1] = null;
+    }
+    *p = entry;
+}
+
 const char *const*EnvGetEnv(void)
 {
     return env;
@@ -124,7 +155,7 @@ const char *const*EnvCreateCopy(vref overrides)
             }
             *p = pname;
         }
-        else
+        else if (*p)
         {
             *p = result[--count];
             result[count] = null;
@@ -2,6 +2,8 @@ void EnvInit(char **environ);
 void EnvDispose(void);
 
 void EnvGet(const char *name, size_t length, const char **value, size_t *valueLength);
+/* Sets a variable in the environment of processes started from now on. */
+nonnull void EnvSet(const char *name, const char *value);
 
 const char *const*EnvGetEnv(void);
 const char *const*EnvCreateCopy(vref overrides);
@@ -528,22 +528,26 @@ bool FileIsExecutable(const char *path, size_t length)
     return feIsFile(fe) && (fe->status.mode & (S_IXUSR | S_IXGRP | S_IXOTH));
 }
 
-static void deleteDirectoryContents(const char *path, int fd)
+/* Deletes the contents of the directory fd refers to. Returns 0, or errno if anything fails. */
+static int deleteDirectoryContents(int fd)
 {
     int fd2;
+    int error;
     DIR *dir;
     struct dirent *d;
 
     assert(fd);
     fd2 = dup(fd);
-    if (unlikely(fd < 0))
+    if (unlikely(fd2 < 0))
     {
-        FailIO("Error duplicating file handle", path);
+        return errno;
     }
     dir = fdopendir(fd2);
     if (unlikely(!dir))
     {
-        FailIO("Error opening directory", path);
+        error = errno;
+        close(fd2);
+        return error;
     }
     for (;;)
     {
@@ -551,10 +555,7 @@ static void deleteDirectoryContents(const char *path, int fd)
         d = readdir(dir);
         if (!d)
         {
-            if (unlikely(errno))
-            {
-                FailIO("Error reading directory", path);
-            }
+            error = errno;
             break;
         }
         if (*d->d_name == '.' &&
@@ -566,29 +567,35 @@ static void deleteDirectoryContents(const char *path, int fd)
         /* TODO: Use d->d_type if available */
         if (unlinkat(fd, d->d_name, 0)) /* TODO: Provide fallback if unlinkat isn't available */
         {
-            char *name = strdup(d->d_name);
-            if (unlikely(errno != EISDIR))
+            error = errno;
+            if (unlikely(error != EISDIR))
             {
-                FailIO("Error deleting file", path);
+                break;
             }
             fd2 = openat(fd, d->d_name, O_CLOEXEC | O_RDONLY | O_DIRECTORY);
             if (unlikely(fd2 < 0))
             {
-                FailIO("Error deleting directory", path);
+                error = errno;
+                break;
             }
-            deleteDirectoryContents(path, fd2); /* TODO: Iterate instead of recurse */
+            error = deleteDirectoryContents(fd2); /* TODO: Iterate instead of recurse */
             close(fd2);
-            if (unlikely(unlinkat(fd, name, AT_REMOVEDIR)))
+            if (unlikely(error))
+            {
+                break;
+            }
+            if (unlikely(unlinkat(fd, d->d_name, AT_REMOVEDIR)))
             {
-                FailIO("Error deleting directory", path);
+                error = errno;
+                break;
             }
-            free(name);
         }
     }
     closedir(dir);
+    return error;
 }
 
-void FileDelete(const char *path, size_t length)
+int FileDeleteBegin(const char *path, size_t length)
 {
     uint index = feIndex(path, length);
     char *pathZ;
@@ -599,7 +606,7 @@ void FileDelete(const char *path, size_t length)
         FileEntry *fe = table + index;
         if (!feExists(fe))
         {
-            return;
+            return -1;
         }
     }
     pathZ = dupPath(path, length);
@@ -607,23 +614,48 @@ void FileDelete(const char *path, size_t length)
     if (!unlink(pathZ) || errno == ENOENT)
     {
         free(pathZ);
-        return;
+        return -1;
     }
     if (unlikely(errno != EISDIR))
     {
         FailIO("Error deleting file", pathZ);
     }
 
-    fd = open(pathZ, O_CLOEXEC | O_RDONLY);
+    fd = open(pathZ, O_CLOEXEC | O_RDONLY | O_DIRECTORY);
     if (unlikely(fd < 0))
     {
         FailIO("Error deleting directory", pathZ);
     }
-    deleteDirectoryContents(pathZ, fd);
+    free(pathZ);
+    return fd;
+}
+
+int FileDeleteDirectory(const char *pathZ, int fd)
+{
+    int error = deleteDirectoryContents(fd);
     close(fd);
-    if (unlikely(rmdir(pathZ)))
+    if (!error && unlikely(rmdir(pathZ)))
     {
-        FailIO("Error deleting directory", pathZ);
+        error = errno;
+    }
+    return error;
+}
+
+void FileDelete(const char *path, size_t length)
+{
+    int fd = FileDeleteBegin(path, length);
+    char *pathZ;
+    int error;
+
+    if (fd < 0)
+    {
+        return;
+    }
+    pathZ = dupPath(path, length);
+    error = FileDeleteDirectory(pathZ, fd);
+    if (unlikely(error))
+    {
+        FailIOErrno("Error deleting directory", pathZ, error);
     }
     free(pathZ);
 }
@@ -669,63 +701,91 @@ bool FileMkdirMutable(char *pathZ, size_t length)
     return false;
 }
 
-void FileCopy(const char *srcPath, size_t srcLength unused,
-              const char *dstPath, size_t dstLength unused)
+bool FileCopyBegin(const char *srcPath, size_t srcLength unused,
+                   const char *dstPath, size_t dstLength, int *srcfd, int *dstfd, size_t *size)
 {
-    int srcfd;
-    int dstfd;
     struct stat srcStat;
     struct stat dstStat;
 
-    srcfd = open(srcPath, O_CLOEXEC | O_RDONLY);
-    if (unlikely(srcfd == -1))
+    *srcfd = open(srcPath, O_CLOEXEC | O_RDONLY);
+    if (unlikely(*srcfd == -1))
     {
         FailIO("Error opening file", srcPath);
     }
-    if (unlikely(fstat(srcfd, &srcStat)))
+    if (unlikely(fstat(*srcfd, &srcStat)))
     {
         FailIO("Error accessing file", srcPath);
     }
     assert(!S_ISDIR(srcStat.st_mode)); /* TODO: Copy directory */
 
     FileMarkModified(dstPath, dstLength);
-    dstfd = open(dstPath, O_CLOEXEC | O_CREAT | O_WRONLY,
-                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-    if (unlikely(dstfd == -1))
+    *dstfd = open(dstPath, O_CLOEXEC | O_CREAT | O_WRONLY,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (unlikely(*dstfd == -1))
     {
         FailIO("Error opening file", dstPath);
     }
-    if (unlikely(fstat(dstfd, &dstStat)))
+    if (unlikely(fstat(*dstfd, &dstStat)))
     {
         FailIO("Error accessing file", dstPath);
     }
-    if (srcStat.st_ino != dstStat.st_ino || srcStat.st_dev != dstStat.st_dev)
+    if (srcStat.st_ino == dstStat.st_ino && srcStat.st_dev == dstStat.st_dev)
     {
-        byte buffer[4096];
-        if (unlikely(ftruncate(dstfd, 0)))
-        {
-            FailIO("Error truncating file", dstPath);
-        }
-        for (;;)
+        close(*srcfd);
+        close(*dstfd);
+        return false;
+    }
+    if (unlikely(ftruncate(*dstfd, 0)))
+    {
+        FailIO("Error truncating file", dstPath);
+    }
+    *size = (size_t)srcStat.st_size;
+    return true;
+}
+
+int FileCopyData(int srcfd, int dstfd)
+{
+    byte buffer[4096];
+    int error = 0;
+
+    for (;;)
+    {
+        ssize_t r = read(srcfd, buffer, sizeof(buffer));
+        if (r <= 0)
         {
-            ssize_t r = read(srcfd, buffer, sizeof(buffer));
-            if (r <= 0)
-            {
-                if (unlikely(r))
-                {
-                    FailIO("Error reading file", srcPath);
-                }
-                break;
-            }
-            if (unlikely(write(dstfd, buffer, (size_t)r) != r))
+            if (unlikely(r))
             {
-                FailIO("Error writing file", dstPath);
+                error = errno;
             }
+            break;
+        }
+        if (unlikely(write(dstfd, buffer, (size_t)r) != r))
+        {
+            error = errno ? errno : EIO;
+            break;
         }
     }
-
     close(srcfd);
     close(dstfd);
+    return error;
+}
+
+void FileCopy(const char *srcPath, size_t srcLength,
+              const char *dstPath, size_t dstLength)
+{
+    int srcfd;
+    int dstfd;
+    size_t size;
+    int error;
+
+    if (FileCopyBegin(srcPath, srcLength, dstPath, dstLength, &srcfd, &dstfd, &size))
+    {
+        error = FileCopyData(srcfd, dstfd);
+        if (unlikely(error))
+        {
+            FailIOErrno("Error copying file", srcPath, error);
+        }
+    }
 }
 
 void FileRename(const char *oldPath, size_t oldLength,
@@ -59,9 +59,27 @@ nonnull void FileWrite(File *file, const byte *buffer, size_t size);
 
 nonnull bool FileIsExecutable(const char *path, size_t length);
 nonnull void FileDelete(const char *path, size_t length);
+/*
+  Does the part of FileDelete that needs the file table. If path is a directory, returns a file
+  descriptor of it for FileDeleteDirectory, otherwise deletes the file and returns -1.
+  FileDeleteDirectory deletes the directory and everything in it without failing, so that it can
+  run on a task thread, and returns 0 or an errno value.
+*/
+nonnull int FileDeleteBegin(const char *path, size_t length);
+nonnull int FileDeleteDirectory(const char *pathZ, int fd);
 nonnull bool FileMkdirMutable(char *pathZ, size_t length);
 nonnull void FileCopy(const char *srcPath, size_t srcLength,
                       const char *dstPath, size_t dstLength);
+/*
+  Does the part of FileCopy that needs the file table: opens both files and truncates the
+  destination. Returns false if they are the same file, and otherwise sets size to the size of the
+  source. FileCopyData then copies the data and closes the files without failing, so that it can
+  run on a task thread, and returns 0 or an errno value.
+*/
+nonnull bool FileCopyBegin(const char *srcPath, size_t srcLength,
+                           const char *dstPath, size_t dstLength,
+                           int *srcfd, int *dstfd, size_t *size);
+int FileCopyData(int srcfd, int dstfd);
 nonnull void FileRename(const char *oldPath, size_t oldLength,
                         const char *newPath, size_t newLength);
 
@@ -15,6 +15,12 @@ typedef struct
     size_t length;
 } SubString;
 
+typedef struct
+{
+    const char *data;
+    size_t length;
+} ExternalString;
+
 
 void HeapInit(void);
 void HeapDispose(void);
@@ -3,7 +3,9 @@
 #include <string.h>
 #include "common.h"
 #include "bytecode.h"
+#include "bytevector.h"
 #include "debug.h"
+#include "hash.h"
 #include "heap.h"
 #include "interpreter.h"
 #include "instruction.h"
@@ -11,10 +13,18 @@
 #include "linker.h"
 #include "main.h"
 #include "native.h"
+#include "util.h"
 /* #include "value.h" */
 #include "vm.h"
 
 static intvector temp;
+static bool keepGoing;
+/* Set once the master VM has continued past a failure, after which it can see future values. */
+static bool abandonedCalls;
+static bytevector failures;
+/* Instructions executed and the time spent executing them, when DEBUG_INSTRUCTIONS is set. */
+static ulong instructionCount;
+static ulong executeMicros;
 
 static void traceLine(const VM* vm, int bytecodeOffset)
 {
@@ -86,6 +96,84 @@ static void popStackFrame(VM *vm, const int **ip, int *bp, uint returnValues)
 }
 
 
+/*
+  Makes the call from the target that led to a failure return VFuture for all its return values,
+  and continues the target after it. Returns false if the failure was in the target itself.
+*/
+static bool abandonCall(VM *vm)
+{
+    uint count;
+
+    assert(!vm->job);
+    if (!IVSize(&vm->callStack))
+    {
+        return false;
+    }
+    IVSetSize(&vm->stack, (size_t)(IVSize(&vm->callStack) > 2 ?
+                                    IVGet(&vm->callStack, 3) : vm->bp));
+    vm->ip = vmBytecode + IVGet(&vm->callStack, 0);
+    vm->bp = IVGet(&vm->callStack, 1);
+    IVSetSize(&vm->callStack, 0);
+    for (count = (uint)*vm->ip++; count; count--)
+    {
+        storeValue(vm, vm->bp, *vm->ip++, VFuture);
+    }
+    vm->failMessage = 0;
+    vm->idle = false;
+    abandonedCalls = true;
+    return true;
+}
+
+/*
+  Fails the master VM because it depends on the result of a call abandoned after an earlier
+  failure. Such failures aren't reported.
+*/
+static bool failDependent(VM *vm)
+{
+    if (vm->base.parent)
+    {
+        return false;
+    }
+    VMHalt(vm, VFuture);
+    return true;
+}
+
+static bool argumentsKnown(VM *vm, nativefunctionref function)
+{
+    uint i;
+    for (i = 0; i < NativeGetParameterCount(function); i++)
+    {
+        if (!VIsKnown(loadValue(vm, vm->bp, vm->ip[i])))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void reportFailure(const VM *vm)
+{
+    const char *filename;
+    char lineString[16];
+    char *msg;
+    size_t start = BVSize(&failures);
+
+    if (vm->failMessage == VFuture)
+    {
+        return;
+    }
+    sprintf(lineString, ":%d: ",
+            BytecodeLineNumber(vmLineNumbers, (int)(vm->ip - vmBytecode), &filename));
+    msg = VGetStringCopy(vm->failMessage);
+    BVAddString(&failures, filename);
+    BVAddString(&failures, lineString);
+    BVAddString(&failures, msg);
+    BVAddString(&failures, "\n");
+    free(msg);
+    fwrite(BVGetPointer(&failures, start), 1, BVSize(&failures) - start, stderr);
+}
+
+
 static VM *execute(VM *vm)
 {
     int maxInstructions = 100;
@@ -99,6 +187,10 @@ static VM *execute(VM *vm)
             traceLine(vm, (int)(vm->ip - vmBytecode));
             fflush(stdout);
         }
+        if (DEBUG_INSTRUCTIONS)
+        {
+            instructionCount++;
+        }
         vm->ip++;
         switch ((Instruction)(i & 0xff))
         {
@@ -215,7 +307,13 @@ static VM *execute(VM *vm)
             if (collection == VFuture)
             {
         iterNextFuture:
-                assert(0);
+                if (!failDependent(vm))
+                {
+                    /* Stop speculating. The parent VM will dispose this VM once it gets past
+                       this loop. */
+                    vm->idle = true;
+                }
+                return vm;
             }
             switch (VGetBool(VValidIndex(vm, collection, index)))
             {
@@ -441,6 +539,10 @@ static VM *execute(VM *vm)
         {
             vref value = loadValue(vm, vm->bp, *vm->ip++);
             VBool b = VGetBool(value);
+            if (unlikely(b == FUTURE) && failDependent(vm))
+            {
+                return vm;
+            }
             vm->base.clonePoints++;
             if (vm->child && vm->base.clonePoints >= vm->child->clonePoints)
             {
@@ -450,7 +552,11 @@ static VM *execute(VM *vm)
                     vm->child = null;
                     goto branchTrueNoChild;
                 }
-                assert(!vm->child->fullVM);
+                if (vm->child->fullVM)
+                {
+                    /* The child got past this branch without depending on a future value. */
+                    goto branchTrueNoChild;
+                }
                 if (b == FUTURE)
                 {
                     VMReplaceCloneBranch(vm, vm->ip + arg);
@@ -479,6 +585,11 @@ static VM *execute(VM *vm)
                     break;
                 case FUTURE:
                     assert(!vm->child);
+                    if (!VMCloneAllowed())
+                    {
+                        vm->idle = true;
+                        return vm;
+                    }
                     VMCloneBranch(vm, vm->ip);
                     /* fallthrough */
                 case TRUTHY:
@@ -493,6 +604,10 @@ static VM *execute(VM *vm)
         {
             vref value = loadValue(vm, vm->bp, *vm->ip++);
             VBool b = VGetBool(value);
+            if (unlikely(b == FUTURE) && failDependent(vm))
+            {
+                return vm;
+            }
             vm->base.clonePoints++;
             if (vm->child && vm->base.clonePoints >= vm->child->clonePoints)
             {
@@ -502,7 +617,11 @@ static VM *execute(VM *vm)
                     vm->child = null;
                     goto branchFalseNoChild;
                 }
-                assert(!vm->child->fullVM);
+                if (vm->child->fullVM)
+                {
+                    /* The child got past this branch without depending on a future value. */
+                    goto branchFalseNoChild;
+                }
                 if (b == FUTURE)
                 {
                     VMReplaceCloneBranch(vm, vm->ip);
@@ -532,6 +651,11 @@ static VM *execute(VM *vm)
                     break;
                 case FUTURE:
                     assert(!vm->child);
+                    if (!VMCloneAllowed())
+                    {
+                        vm->idle = true;
+                        return vm;
+                    }
                     VMCloneBranch(vm, vm->ip);
                     /* fallthrough */
                 case FALSY:
@@ -578,12 +702,21 @@ static VM *execute(VM *vm)
             vref value;
             int storeAt;
             assert(!vm->job);
+            if (unlikely(abandonedCalls) && !vm->base.parent &&
+                !argumentsKnown(vm, nativeFunction) && failDependent(vm))
+            {
+                return vm;
+            }
             vm->base.clonePoints++;
-            if (vm->child && vm->base.clonePoints >= vm->child->clonePoints)
+            if (vm->child && vm->base.clonePoints > vm->child->clonePoints)
+            {
+                VMDispose(vm->child);
+                vm->child = null;
+            }
+            else if (vm->child && vm->base.clonePoints == vm->child->clonePoints)
             {
-                VM *child = (VM*)vm->child;
                 assert(vm->child->fullVM);
-                VMReplaceChild(vm, child);
+                VMReplaceChild(vm, (VM*)vm->child);
             }
             value = NativeInvoke(vm, nativeFunction);
             if (vm->idle)
@@ -596,14 +729,12 @@ static VM *execute(VM *vm)
             {
                 vm->job->storeAt = storeAt;
                 vm->idle = true;
-
-                /* TODO: Activate speculative execution */
-                JobExecute(vm->job);
-                if (unlikely(vm->failMessage))
+                if (!vm->child && vm->job->state != JOB_FINISHED && VMCloneAllowed())
                 {
-                    return vm;
+                    /* Continue speculatively with a future value until the job has finished. */
+                    return VMClone(vm, vm->ip);
                 }
-                /* vm = VMClone(vm, vm->ip); */
+                return vm;
             }
             break;
         }
@@ -629,9 +760,21 @@ static VM *execute(VM *vm)
     return vm;
 }
 
-void InterpreterExecute(const LinkedProgram *program, int target)
+void InterpreterInit(bool keepGoingAfterFailure)
+{
+    keepGoing = keepGoingAfterFailure;
+    BVInit(&failures, 256);
+}
+
+void InterpreterDispose(void)
+{
+    BVDispose(&failures);
+}
+
+bool InterpreterExecute(const LinkedProgram *program, int target)
 {
     VM *masterVM;
+    bool failed = false;
 
     IVInit(&temp, 16);
     vmBytecode = program->bytecode;
@@ -653,8 +796,12 @@ void InterpreterExecute(const LinkedProgram *program, int target)
                 VM *vm = (VM*)vmBase;
                 if (!vm->idle)
                 {
-                    /* TODO: Cloning new VMs can cause infinite traversal. */
+                    ulong time = DEBUG_INSTRUCTIONS ? UtilTimeMicros() : 0;
                     vm = execute(vm);
+                    if (DEBUG_INSTRUCTIONS)
+                    {
+                        executeMicros += UtilTimeMicros() - time;
+                    }
                     idle = false;
                 }
                 else if (vm->child)
@@ -697,34 +844,59 @@ void InterpreterExecute(const LinkedProgram *program, int target)
         }
 done:
 
-        if (idle)
+        JobPoll();
+        JobSchedule(idle);
+        if (idle && masterVM->idle)
         {
-            if (masterVM->job)
+            if (!masterVM->job)
             {
-                JobExecute(masterVM->job);
+                if (keepGoing && masterVM->failMessage && IVSize(&masterVM->callStack))
+                {
+                    /* Continue with the parts of the target not depending on the failure. */
+                    reportFailure(masterVM);
+                    failed = true;
+                    abandonCall(masterVM);
+                    continue;
+                }
+                break;
             }
-            else if (masterVM->idle)
+            if (!JobWait())
             {
-                break;
+                unreachable;
             }
         }
     }
 
+    /* Wait for discarded jobs to terminate. */
+    while (JobWait());
+
     if (masterVM->failMessage)
     {
-        const char *filename;
-        int line = BytecodeLineNumber(program->lineNumbers,
-                                      (int)(masterVM->ip - vmBytecode), &filename);
-        char *msg = VGetStringCopy(masterVM->failMessage);
-        fprintf(stderr, "%s:%d: %s\n", filename, line, msg);
-#ifdef VALGRIND
-        free(msg);
-#endif
-        cleanShutdown(EXIT_FAILURE);
+        reportFailure(masterVM);
+        if (!keepGoing)
+        {
+            cleanShutdown(EXIT_FAILURE);
+        }
+        failed = true;
     }
 
 #ifdef VALGRIND
     VMDispose(&masterVM->base);
     IVDispose(&temp);
 #endif
+    return !failed;
+}
+
+void InterpreterPrintStatistics(void)
+{
+    double seconds = (double)executeMicros / 1e6;
+
+    fprintf(stderr, "interpreter: %lu instructions in %luus, %.0f/s\n",
+            instructionCount, executeMicros,
+            seconds > 0 ? (double)instructionCount / seconds : 0.0);
+}
+
+void InterpreterPrintFailures(void)
+{
+    fwrite(BVGetPointer(&failures, 0), 1, BVSize(&failures), stderr);
 }
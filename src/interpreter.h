@@ -1,2 +1,20 @@
 struct _LinkedProgram;
-nonnull void InterpreterExecute(const struct _LinkedProgram *program, int target);
+
+/*
+  If keepGoingAfterFailure is set, a failure only abandons the call from the target that led to
+  it. The target then continues, and any later use of the results of the abandoned call fails too.
+*/
+void InterpreterInit(bool keepGoingAfterFailure);
+void InterpreterDispose(void);
+
+/*
+  Runs the target. Returns false if it failed. Without keep-going, a failure ends the process
+  instead.
+*/
+nonnull bool InterpreterExecute(const struct _LinkedProgram *program, int target);
+
+/* Prints the failures of all targets again. */
+void InterpreterPrintFailures(void);
+
+/* Prints instructions executed per second, when DEBUG_INSTRUCTIONS is set. */
+void InterpreterPrintStatistics(void);
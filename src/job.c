@@ -1,13 +1,69 @@
 #include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "common.h"
 #include "bytevector.h"
+#include "cache.h"
 #include "debug.h"
+#include "fail.h"
+#include "hash.h"
 #include "native.h"
 #include "job.h"
+#include "jobserver.h"
+#include "load.h"
+#include "pipe.h"
+#include "spawn.h"
+#include "task.h"
+#include "util.h"
 #include "value.h"
 #include "vm.h"
+#include "worker.h"
+
+/* Milliseconds between SIGTERM and SIGKILL for discarded jobs. */
+#define KILL_GRACE_PERIOD 2000
+/* Milliseconds between checks for exited processes that have closed their output, if their exit
+   can't be watched for. */
+#define REAP_INTERVAL 10
+/* Milliseconds between attempts to start jobs held back because the machine is loaded. */
+#define THROTTLE_INTERVAL 100
+
+typedef struct
+{
+    vref name;
+    uint depth;
+    uint running;
+} Pool;
+
+typedef struct
+{
+    char *executable;
+    ulong count;
+    ulong wallTime; /* ms */
+    JobUsage usage; /* Summed, except maxRSS which is the largest. */
+} ReportEntry;
+
+static bytevector jobs; /* Job* of all queued, running and finished jobs, in the order added. */
+static bytevector startOrder; /* Job* of jobs that can be started, used by JobSchedule. */
+static uint maxRunning;
+static bool echoOnCompletion;
+static uint running;
+static uint runningTasks; /* Not counted in running, as they don't take job slots. */
+static bool throttled;
+static bool partsAdded;
+static bool partsDiscarded;
+static bytevector report; /* ReportEntry per executable of the processes run so far. */
+static bytevector pools; /* Pool */
+/* A signal to forward to the running jobs before exiting, and a pipe written to when it arrives. */
+static volatile sig_atomic_t receivedSignal;
+static int signalPipe[2];
+
 
 static void printJob(const char *prefix, const Job *job)
 {
@@ -32,17 +88,887 @@ static void printJob(const char *prefix, const Job *job)
     BVDispose(&buffer);
 }
 
-Job *JobAdd(JobFunction function, VM *vm, const vref *arguments, uint argumentCount,
-              vref accessedFiles, vref modifiedFiles)
+static size_t jobCount(void)
+{
+    return BVSize(&jobs) / sizeof(Job*);
+}
+
+static Job *getJob(size_t index)
+{
+    return *(Job**)BVGetPointer(&jobs, index * sizeof(Job*));
+}
+
+static void removeJob(Job *job)
+{
+    size_t i;
+    for (i = 0;; i++)
+    {
+        assert(i < jobCount());
+        if (getJob(i) == job)
+        {
+            BVRemoveRange(&jobs, i * sizeof(Job*), sizeof(Job*));
+            break;
+        }
+    }
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *follower = getJob(i);
+        if (follower->leader == job)
+        {
+            follower->leader = null;
+        }
+    }
+    if (job->fdIn >= 0)
+    {
+        close(job->fdIn);
+    }
+    if (job->fdOut >= 0)
+    {
+        close(job->fdOut);
+    }
+    if (job->tracePath)
+    {
+        unlink(job->tracePath);
+        free(job->tracePath);
+    }
+    free(job->executable);
+    free(job->taskData);
+    free(job->partResults);
+    free(job);
+}
+
+/* Returns the unfinished part of group that was added first. */
+static Job *currentPart(const Job *group)
+{
+    Job *part = null;
+    size_t i;
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *job = getJob(i);
+        if (job->group == group && (!part || job->storeAt < part->storeAt))
+        {
+            part = job;
+        }
+    }
+    return part;
+}
+
+/*
+  Signals the process group of the job, or only its process if it doesn't have a group. Tasks can't
+  be signalled.
+*/
+static void signalJob(const Job *job, int sig)
+{
+    if (job->task >= 0)
+    {
+        return;
+    }
+    if (job->worker >= 0)
+    {
+        WorkerSignal(job->worker, sig);
+    }
+    else if (kill(-job->pid, sig))
+    {
+        kill(job->pid, sig);
+    }
+}
+
+/*
+  Only records the signal, as the jobs can't be walked safely in a signal handler. The pipe wakes up
+  PipeProcess, after which finishJobs forwards the signal.
+*/
+static void recordSignal(int sig)
+{
+    int oldErrno = errno;
+    ssize_t unused writeSize;
+    receivedSignal = sig;
+    writeSize = write(signalPipe[1], "", 1);
+    errno = oldErrno;
+}
+
+/* Forwards a received signal to the running jobs, and then lets it terminate don. */
+static void forwardSignal(void)
+{
+    int sig = receivedSignal;
+    size_t i;
+    if (likely(!sig))
+    {
+        return;
+    }
+    for (i = 0; i < jobCount(); i++)
+    {
+        const Job *job = getJob(i);
+        if (job->state == JOB_RUNNING)
+        {
+            signalJob(job, sig);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void ignoreSignal(int sig unused)
+{
+}
+
+static bool argumentsEqual(const Job *job, const vref *arguments)
+{
+    const vref *p = (const vref*)(job + 1);
+    uint i;
+    for (i = 0; i < job->argumentCount; i++)
+    {
+        if (VEquals(p[i], arguments[i]) != VTrue)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Computes the digest of the arguments and file sets, unless some of them aren't known yet. */
+static bool hashArguments(Job *job)
+{
+    const vref *p = (const vref*)(job + 1);
+    HashState hashState;
+    uint i;
+
+    if (job->hashed)
+    {
+        return true;
+    }
+    if (!VIsKnown(job->accessedFiles) || !VIsKnown(job->modifiedFiles))
+    {
+        return false;
+    }
+    for (i = 0; i < job->argumentCount; i++)
+    {
+        if (!VIsKnown(p[i]))
+        {
+            return false;
+        }
+    }
+    HashInit(&hashState);
+    for (i = 0; i < job->argumentCount; i++)
+    {
+        VHash(p[i], &hashState);
+    }
+    VHash(job->accessedFiles, &hashState);
+    VHash(job->modifiedFiles, &hashState);
+    HashFinal(&hashState, job->digest);
+    job->hashed = true;
+    return true;
+}
+
+static bool hasProcess(const Job *job)
+{
+    return job->vm && !job->leader && !job->result &&
+        (job->state == JOB_RUNNING || job->state == JOB_FINISHED);
+}
+
+/* Returns a job that has started a process with the same function and arguments as job. */
+static Job *findProcess(const Job *job)
+{
+    size_t i;
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *other = getJob(i);
+        if (other != job && other->function == job->function && other->hashed &&
+            hasProcess(other) && !memcmp(other->digest, job->digest, DIGEST_SIZE))
+        {
+            return other;
+        }
+    }
+    return null;
+}
+
+static Job *findFollower(const Job *job)
+{
+    size_t i;
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *follower = getJob(i);
+        if (follower->leader == job)
+        {
+            return follower;
+        }
+    }
+    return null;
+}
+
+/* Moves the process of from to to, which takes over the followers of from. */
+static void transferProcess(Job *from, Job *to)
+{
+    size_t i;
+
+    if (DEBUG_JOB)
+    {
+        printJob("transfer job: ", from);
+        printJob("          to: ", to);
+    }
+    assert(to->state == JOB_QUEUED);
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *follower = getJob(i);
+        if (follower->leader == from)
+        {
+            follower->leader = to;
+        }
+    }
+    to->leader = null;
+    to->finish = from->finish;
+    to->state = from->state;
+    to->pid = from->pid;
+    to->worker = from->worker;
+    to->exitWatch = from->exitWatch;
+    to->status = from->status;
+    to->pipeIn = from->pipeIn;
+    to->pipeOut = from->pipeOut;
+    to->pipeErr = from->pipeErr;
+    to->echoOut = from->echoOut;
+    to->echoErr = from->echoErr;
+    free(to->executable);
+    to->executable = from->executable;
+    to->pool = from->pool;
+    to->token = from->token;
+    if (to->tracePath)
+    {
+        unlink(to->tracePath);
+        free(to->tracePath);
+    }
+    to->tracePath = from->tracePath;
+    to->startTime = from->startTime;
+    to->duration = from->duration;
+    to->usage = from->usage;
+    from->finish = null;
+    from->state = JOB_QUEUED;
+    from->pid = 0;
+    from->worker = -1;
+    from->exitWatch = -1;
+    from->pipeIn = -1;
+    from->pipeOut = -1;
+    from->pipeErr = -1;
+    from->echoOut = false;
+    from->echoErr = false;
+    from->executable = null;
+    from->pool = 0;
+    from->token = -1;
+    from->tracePath = null;
+}
+
+static void disposePipes(Job *job)
+{
+    if (job->pipeIn >= 0)
+    {
+        PipeDispose(job->pipeIn, null);
+        job->pipeIn = -1;
+    }
+    if (job->pipeOut >= 0)
+    {
+        PipeDispose(job->pipeOut, null);
+        job->pipeOut = -1;
+    }
+    if (job->pipeErr >= 0)
+    {
+        PipeDispose(job->pipeErr, null);
+        job->pipeErr = -1;
+    }
+}
+
+static void echoOutput(Job *job)
+{
+    if (echoOnCompletion ? job->state != JOB_FINISHED : job->vm->base.parent != null)
+    {
+        return;
+    }
+    if (!echoOnCompletion && job->group && currentPart(job->group) != job)
+    {
+        return;
+    }
+    if (job->echoOut)
+    {
+        PipeConnect(job->pipeOut, STDOUT_FILENO);
+        job->echoOut = false;
+    }
+    if (job->echoErr)
+    {
+        PipeConnect(job->pipeErr, STDOUT_FILENO);
+        job->echoErr = false;
+    }
+}
+
+static void deliver(Job *job, vref value)
+{
+    VM *vm = job->vm;
+    assert(vm->job == job);
+    vm->job = null;
+    vm->stepTime += job->duration;
+    if (value)
+    {
+        VMStoreValue(vm, job->storeAt, value);
+        vm->idle = false;
+    }
+    else
+    {
+        assert(vm->failMessage);
+    }
+    removeJob(job);
+}
+
+/*
+  A job of a speculatively executing VM may only be started if it can't modify anything outside
+  the cache directory, and if none of the files it accesses or modifies can be changed by side
+  effects preceding it. Cache files are only written by the step owning the cache entry, so jobs
+  of parent VMs reading them need not be considered.
+*/
+static bool canStart(const Job *job)
+{
+    size_t index;
+    vref value;
+    const char *path;
+    size_t length;
+
+    if (!job->vm->base.parent)
+    {
+        return true;
+    }
+    if (job->accessedFiles == VFuture || job->modifiedFiles == VFuture)
+    {
+        return false;
+    }
+    for (index = 0; VCollectionGet(job->modifiedFiles, VBoxSize(index++), &value);)
+    {
+        path = VGetPath(value, &length);
+        if (!CacheContainsPath(path, length) || !JobIsPathStable(job->vm, path, length))
+        {
+            return false;
+        }
+    }
+    for (index = 0; VCollectionGet(job->accessedFiles, VBoxSize(index++), &value);)
+    {
+        path = VGetPath(value, &length);
+        if (!JobIsPathStable(job->vm, path, length))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void finishPart(Job *part, vref value);
+
+/* Returns the part reading the output of part, if it hasn't been started yet. */
+static Job *findLinkedPart(const Job *part)
+{
+    size_t i;
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *job = getJob(i);
+        if (job->group == part->group && job->storeAt == part->storeAt + 1 &&
+            job->state == JOB_QUEUED && job->fdIn >= 0)
+        {
+            return job;
+        }
+    }
+    return null;
+}
+
+static void startJob(Job *job)
+{
+    Job *linked;
+
+    vref value;
+
+    if (DEBUG_JOB)
+    {
+        printJob("start job: ", job);
+    }
+
+    assert(job->vm->job == (job->group ? job->group : job));
+    assert(job->state == JOB_QUEUED);
+    value = job->function(job, (vref*)(job + 1));
+    if (job->state == JOB_RUNNING)
+    {
+        assert(!value);
+        job->startTime = UtilTimeMillis();
+        job->exitWatch = job->worker < 0 ? PipeWatchProcess(job->pid) : -1;
+        running++;
+        echoOutput(job);
+        linked = job->group ? findLinkedPart(job) : null;
+        if (linked)
+        {
+            startJob(linked);
+        }
+    }
+    else if (job->state == JOB_WAITING)
+    {
+        assert(!value);
+    }
+    else if (value && job->vm->base.parent)
+    {
+        /* Kept like the result of a finished process, until the master VM takes over the job. */
+        job->state = JOB_FINISHED;
+        job->result = value;
+    }
+    else if (value || job->vm->failMessage)
+    {
+        if (job->group)
+        {
+            finishPart(job, value);
+        }
+        else
+        {
+            deliver(job, value);
+        }
+    }
+}
+
+/*
+  Makes job share the process of a job with the same arguments instead of starting one. Returns
+  true if it does.
+*/
+static bool followJob(Job *job)
+{
+    Job *leader = job->leader;
+
+    if (!leader)
+    {
+        /* Processes connected to other parts can't be shared. */
+        if (job->fdIn >= 0 || job->fdOut >= 0 || !hashArguments(job))
+        {
+            return false;
+        }
+        leader = findProcess(job);
+        if (!leader)
+        {
+            return false;
+        }
+        if (DEBUG_JOB)
+        {
+            printJob("follow job: ", job);
+        }
+    }
+    if (job->vm->base.parent || !leader->vm->base.parent)
+    {
+        job->leader = leader;
+        return true;
+    }
+    /* The master VM would wait forever for a speculatively executing one. */
+    transferProcess(leader, job);
+    leader->leader = job;
+    echoOutput(job);
+    return true;
+}
+
+/* Gives the result of job to the jobs following it. */
+static void shareResult(const Job *job, vref value)
+{
+    size_t i;
+    for (i = 0; i < jobCount(); i++)
+    {
+        Job *follower = getJob(i);
+        if (follower->leader == job)
+        {
+            follower->leader = null;
+            follower->state = JOB_FINISHED;
+            follower->result = value;
+            follower->duration = job->duration;
+            follower->usage = job->usage;
+        }
+    }
+}
+
+static bool isOutputClosed(const Job *job)
+{
+    return (job->pipeOut < 0 || !PipeIsOpen(job->pipeOut)) &&
+        (job->pipeErr < 0 || !PipeIsOpen(job->pipeErr));
+}
+
+static ulong timevalMillis(const struct timeval *time)
+{
+    return (ulong)time->tv_sec * 1000 + (ulong)time->tv_usec / 1000;
+}
+
+static void addToReport(const Job *job)
+{
+    ReportEntry *entry = (ReportEntry*)BVGetPointer(&report, 0);
+    ReportEntry *stop = (ReportEntry*)((byte*)entry + BVSize(&report));
+
+    for (; entry < stop && strcmp(entry->executable, job->executable); entry++);
+    if (entry == stop)
+    {
+        entry = (ReportEntry*)BVGetAppendPointer(&report, sizeof(ReportEntry));
+        memset(entry, 0, sizeof(*entry));
+        entry->executable = (char*)malloc(strlen(job->executable) + 1);
+        strcpy(entry->executable, job->executable);
+    }
+    entry->count++;
+    entry->wallTime += job->duration;
+    entry->usage.userTime += job->usage.userTime;
+    entry->usage.systemTime += job->usage.systemTime;
+    entry->usage.maxRSS = max(entry->usage.maxRSS, job->usage.maxRSS);
+    entry->usage.blockInput += job->usage.blockInput;
+    entry->usage.blockOutput += job->usage.blockOutput;
+    entry->usage.voluntarySwitches += job->usage.voluntarySwitches;
+    entry->usage.involuntarySwitches += job->usage.involuntarySwitches;
+}
+
+static bool reapTask(Job *job)
+{
+    if (!TaskReap(job->task, &job->status))
+    {
+        return false;
+    }
+    job->task = -1;
+    job->state = JOB_FINISHED;
+    job->duration = UtilTimeMillis() - job->startTime;
+    assert(runningTasks);
+    runningTasks--;
+    return true;
+}
+
+static bool reap(Job *job)
+{
+    struct rusage usage;
+
+    if (job->task >= 0)
+    {
+        return reapTask(job);
+    }
+    if (job->worker >= 0 ? !WorkerReap(job->worker, &job->status, &usage) :
+        !SpawnReap(job->pid, &job->status, &usage))
+    {
+        return false;
+    }
+    job->worker = -1;
+    job->usage.userTime = timevalMillis(&usage.ru_utime);
+    job->usage.systemTime = timevalMillis(&usage.ru_stime);
+    job->usage.maxRSS = (ulong)usage.ru_maxrss;
+    job->usage.blockInput = (ulong)usage.ru_inblock;
+    job->usage.blockOutput = (ulong)usage.ru_oublock;
+    job->usage.voluntarySwitches = (ulong)usage.ru_nvcsw;
+    job->usage.involuntarySwitches = (ulong)usage.ru_nivcsw;
+    if (job->exitWatch >= 0)
+    {
+        PipeUnwatchProcess(job->exitWatch);
+        job->exitWatch = -1;
+    }
+    job->state = JOB_FINISHED;
+    job->duration = UtilTimeMillis() - job->startTime;
+    if (job->executable && job->vm)
+    {
+        LoadRecordPeakMemory(job->executable, job->usage.maxRSS);
+        addToReport(job);
+    }
+    if (job->pool)
+    {
+        ((Pool*)BVGetWritePointer(&pools, (job->pool - 1) * sizeof(Pool)))->running--;
+        job->pool = 0;
+    }
+    JobserverRelease(job->token);
+    job->token = -1;
+    assert(running);
+    running--;
+    return true;
+}
+
+static void discardParts(Job *group)
+{
+    Job *part;
+    while ((part = currentPart(group)) != null)
+    {
+        part->group = null;
+        JobDiscard(part);
+        partsDiscarded = true;
+    }
+}
+
+static void finishJob(Job *job);
+
+static void finishPart(Job *part, vref value)
+{
+    Job *group = part->group;
+    Job *next;
+
+    removeJob(part);
+    if (!value)
+    {
+        discardParts(group);
+        deliver(group, 0);
+        return;
+    }
+    group->partResults[part->storeAt] = value;
+    group->duration = max(group->duration, part->duration);
+    next = currentPart(group);
+    if (!next)
+    {
+        deliver(group, VCreateArrayFromData(group->partResults, group->partCount));
+        return;
+    }
+    /* Parts finish in order when their output is echoed in program order. */
+    echoOutput(next);
+    if (next->state == JOB_FINISHED)
+    {
+        finishJob(next);
+    }
+}
+
+static void finishJob(Job *job)
+{
+    vref value;
+
+    if (DEBUG_JOB)
+    {
+        printJob("finish job: ", job);
+    }
+
+    if (!job->vm)
+    {
+        removeJob(job);
+        return;
+    }
+    echoOutput(job);
+    value = job->result ? job->result : job->finish(job, (vref*)(job + 1));
+    if (value)
+    {
+        shareResult(job, value);
+    }
+    if (job->group)
+    {
+        finishPart(job, value);
+        return;
+    }
+    deliver(job, value);
+}
+
+/*
+  Finishes jobs whose processes have exited. The results of jobs owned by speculatively executing
+  VMs are kept until the master VM takes over the job. Returns true if any process has exited.
+*/
+static bool finishJobs(void)
+{
+    size_t i;
+    bool finished = false;
+
+    forwardSignal();
+    WorkerProcess();
+    TaskProcess();
+    for (i = 0; i < jobCount();)
+    {
+        Job *job = getJob(i);
+        if (job->state == JOB_RUNNING)
+        {
+            if (!job->vm && job->killTime && UtilTimeMillis() >= job->killTime)
+            {
+                signalJob(job, SIGKILL);
+                job->killTime = 0;
+            }
+            if (isOutputClosed(job) && reap(job))
+            {
+                finished = true;
+                if (job->vm)
+                {
+                    echoOutput(job);
+                }
+            }
+        }
+        if (job->state == JOB_FINISHED && (!job->vm || !job->vm->base.parent) &&
+            (!job->group || echoOnCompletion || currentPart(job->group) == job))
+        {
+            finishJob(job);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return finished;
+}
+
+/*
+  Returns how long to wait for pipes before checking jobs again: until the next discarded job is to
+  be killed, or REAP_INTERVAL if a process that has closed its output can't be watched for exiting.
+*/
+static int waitTimeout(void)
+{
+    size_t i;
+    ulong now = 0;
+    int timeout = -1;
+    for (i = 0; i < jobCount(); i++)
+    {
+        const Job *job = getJob(i);
+        if (job->state != JOB_RUNNING)
+        {
+            continue;
+        }
+        if (job->exitWatch < 0 && job->worker < 0 && job->task < 0 && isOutputClosed(job))
+        {
+            return REAP_INTERVAL;
+        }
+        if (job->killTime)
+        {
+            int delay;
+            if (!now)
+            {
+                now = UtilTimeMillis();
+            }
+            delay = job->killTime > now ? (int)min(job->killTime - now, INT_MAX) : 0;
+            timeout = timeout < 0 ? delay : min(timeout, delay);
+        }
+    }
+    return timeout;
+}
+
+
+void JobInit(uint maxRunningJobs, bool outputOnCompletion)
+{
+    assert(maxRunningJobs);
+    maxRunning = maxRunningJobs;
+    echoOnCompletion = outputOnCompletion;
+    if (pipe(signalPipe))
+    {
+        FailErrno(false);
+    }
+    fcntl(signalPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(signalPipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(signalPipe[1], F_SETFL, O_NONBLOCK);
+    PipeWatchInput(signalPipe[0]);
+    signal(SIGHUP, recordSignal);
+    signal(SIGINT, recordSignal);
+    signal(SIGTERM, recordSignal);
+    /* Writing to a process that doesn't read all of its stdin fails instead of killing don. Unlike
+       SIG_IGN, a handler isn't inherited by the processes. */
+    signal(SIGPIPE, ignoreSignal);
+    BVInit(&jobs, maxRunningJobs * 2 * sizeof(Job*));
+    BVInit(&startOrder, maxRunningJobs * 2 * sizeof(Job*));
+    BVInit(&report, 16 * sizeof(ReportEntry));
+    BVInit(&pools, 4 * sizeof(Pool));
+}
+
+void JobDispose(void)
+{
+    ReportEntry *entry = (ReportEntry*)BVGetPointer(&report, 0);
+    ReportEntry *stop = (ReportEntry*)((byte*)entry + BVSize(&report));
+    for (; entry < stop; entry++)
+    {
+        free(entry->executable);
+    }
+    BVDispose(&jobs);
+    BVDispose(&startOrder);
+    BVDispose(&report);
+    BVDispose(&pools);
+}
+
+void JobPrintReport(void)
+{
+    ReportEntry *entries;
+    size_t count = BVSize(&report) / sizeof(ReportEntry);
+    size_t i;
+    size_t j;
+
+    if (!count)
+    {
+        return;
+    }
+    entries = (ReportEntry*)BVGetWritePointer(&report, 0);
+    /* Longest total wall-clock time first. */
+    for (i = 1; i < count; i++)
+    {
+        ReportEntry entry = entries[i];
+        for (j = i; j && entries[j - 1].wallTime < entry.wallTime; j--)
+        {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = entry;
+    }
+    fprintf(stderr, "%8s %10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+            "count", "wall ms", "user ms", "sys ms", "max kB", "blk in", "blk out",
+            "vol csw", "invol csw", "executable");
+    for (i = 0; i < count; i++)
+    {
+        const ReportEntry *entry = &entries[i];
+        fprintf(stderr, "%8lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu  %s\n",
+                entry->count, entry->wallTime, entry->usage.userTime, entry->usage.systemTime,
+                entry->usage.maxRSS, entry->usage.blockInput, entry->usage.blockOutput,
+                entry->usage.voluntarySwitches, entry->usage.involuntarySwitches,
+                entry->executable);
+    }
+}
+
+static void initJob(Job *job, JobFunction function, VM *vm, const vref *arguments,
+                    uint argumentCount, vref accessedFiles, vref modifiedFiles)
 {
-    Job *job = vm->job ? vm->job : (Job*)malloc(sizeof(Job) + argumentCount * sizeof(vref));
-    assert(!vm->job || job->argumentCount == argumentCount);
     job->function = function;
+    job->finish = null;
     job->vm = vm;
     job->accessedFiles = accessedFiles;
     job->modifiedFiles = modifiedFiles;
     job->argumentCount = argumentCount;
+    job->state = JOB_QUEUED;
+    job->pid = 0;
+    job->worker = -1;
+    job->task = -1;
+    job->taskData = null;
+    job->exitWatch = -1;
+    job->pipeIn = -1;
+    job->pipeOut = -1;
+    job->pipeErr = -1;
+    job->fdIn = -1;
+    job->fdOut = -1;
+    job->echoOut = false;
+    job->echoErr = false;
+    job->killTime = 0;
+    job->executable = null;
+    job->pool = 0;
+    job->token = -1;
+    job->tracePath = null;
+    job->priority = vm->stepEstimate;
+    job->startTime = 0;
+    job->duration = 0;
+    job->leader = null;
+    job->result = 0;
+    job->hashed = false;
+    job->group = null;
+    job->partResults = null;
+    job->partCount = 0;
     memcpy(job + 1, arguments, argumentCount * sizeof(vref));
+}
+
+Job *JobAdd(JobFunction function, VM *vm, const vref *arguments, uint argumentCount,
+              vref accessedFiles, vref modifiedFiles)
+{
+    Job *job = vm->job;
+    size_t i;
+
+    if (job)
+    {
+        assert(job->argumentCount == argumentCount);
+        if (job->state != JOB_QUEUED)
+        {
+            /* Started by a speculatively executing VM that has been replaced by vm. */
+            assert(argumentsEqual(job, arguments));
+            if (DEBUG_JOB)
+            {
+                printJob("take over job: ", job);
+            }
+            for (i = 0; i < jobCount(); i++)
+            {
+                Job *part = getJob(i);
+                if (part->group == job)
+                {
+                    part->vm = vm;
+                    echoOutput(part);
+                }
+            }
+            echoOutput(job);
+            return job;
+        }
+    }
+    else
+    {
+        job = (Job*)malloc(sizeof(Job) + argumentCount * sizeof(vref));
+        BVAddData(&jobs, (const byte*)&job, sizeof(job));
+    }
+    initJob(job, function, vm, arguments, argumentCount, accessedFiles, modifiedFiles);
     if (DEBUG_JOB)
     {
         if (vm->job)
@@ -59,39 +985,268 @@ Job *JobAdd(JobFunction function, VM *vm, const vref *arguments, uint argumentCo
 
 void JobDiscard(Job *job)
 {
+    Job *follower;
+
     if (DEBUG_JOB)
     {
         printJob("remove job: ", job);
     }
-    free(job);
+    if (hasProcess(job))
+    {
+        follower = findFollower(job);
+        if (follower)
+        {
+            transferProcess(job, follower);
+            removeJob(job);
+            return;
+        }
+    }
+    if (job->state == JOB_WAITING)
+    {
+        discardParts(job);
+    }
+    if (job->state == JOB_RUNNING)
+    {
+        signalJob(job, SIGTERM);
+        job->killTime = UtilTimeMillis() + KILL_GRACE_PERIOD;
+        disposePipes(job);
+        job->vm = null;
+        return;
+    }
+    if (job->state == JOB_FINISHED)
+    {
+        disposePipes(job);
+    }
+    removeJob(job);
 }
 
-void JobExecute(Job *job)
+Job *JobAddTask(int (*function)(void*), void *data, JobFunction finish, VM *vm,
+                const vref *arguments, uint argumentCount, vref accessedFiles,
+                vref modifiedFiles)
 {
-    vref value;
+    Job *job;
 
+    assert(!vm->job);
+    job = JobAdd(finish, vm, arguments, argumentCount, accessedFiles, modifiedFiles);
+    job->finish = finish;
+    job->state = JOB_RUNNING;
+    job->task = TaskStart(function, data);
+    job->taskData = data;
+    job->startTime = UtilTimeMillis();
+    runningTasks++;
     if (DEBUG_JOB)
     {
-        printJob("execute job: ", job);
+        printJob("start task: ", job);
     }
+    return job;
+}
 
-    assert(job->vm->job == job);
-    value = job->function(job, (vref*)(job + 1));
-    if (value)
+Job *JobAddPart(Job *group, JobFunction function, const vref *arguments, uint argumentCount)
+{
+    Job *job = (Job*)malloc(sizeof(Job) + argumentCount * sizeof(vref));
+    BVAddData(&jobs, (const byte*)&job, sizeof(job));
+    initJob(job, function, group->vm, arguments, argumentCount, group->accessedFiles,
+            group->modifiedFiles);
+    job->group = group;
+    job->storeAt = (int)group->partCount++;
+    group->partResults = (vref*)realloc(group->partResults, group->partCount * sizeof(vref));
+    partsAdded = true;
+    if (DEBUG_JOB)
+    {
+        printJob("add part: ", job);
+    }
+    return job;
+}
+
+static Pool *getPool(vref name)
+{
+    size_t i;
+    for (i = 0; i < BVSize(&pools); i += sizeof(Pool))
     {
-        VMStoreValue(job->vm, job->storeAt, value);
-        job->vm->idle = false;
-        job->vm->job = null;
-        free(job);
+        Pool *pool = (Pool*)BVGetWritePointer(&pools, i);
+        if (VEquals(pool->name, name) == VTrue)
+        {
+            return pool;
+        }
     }
-    else if (job->vm->failMessage)
+    return null;
+}
+
+void JobSetPool(vref name, uint depth)
+{
+    Pool *pool = getPool(name);
+
+    assert(depth);
+    if (!pool)
     {
-        job->vm->job = null;
-        free(job);
+        pool = (Pool*)BVGetAppendPointer(&pools, sizeof(Pool));
+        pool->name = name;
+        pool->running = 0;
     }
-    else
+    pool->depth = depth;
+}
+
+bool JobAdmitProcess(Job *job, const char *executable, vref poolName, bool remote)
+{
+    Pool *pool = null;
+    int token = -1;
+
+    if (job->fdIn < 0)
+    {
+        if (poolName != VNull)
+        {
+            pool = getPool(poolName);
+            if (!pool)
+            {
+                char *name = VGetStringCopy(poolName);
+                VMFailf(job->vm, "Undeclared pool: %s", name);
+                free(name);
+                return false;
+            }
+            if (pool->running >= pool->depth)
+            {
+                return false;
+            }
+        }
+        if (!remote && !JobserverAcquire(running, &token))
+        {
+            throttled = true;
+            return false;
+        }
+        if (!remote && !LoadAdmit(executable, running))
+        {
+            JobserverRelease(token);
+            throttled = true;
+            return false;
+        }
+    }
+    job->token = token;
+    if (pool)
+    {
+        pool->running++;
+        job->pool = 1 + (uint)((size_t)((byte*)pool - (const byte*)BVGetPointer(&pools, 0)) /
+                               sizeof(Pool));
+    }
+    free(job->executable);
+    job->executable = (char*)malloc(strlen(executable) + 1);
+    strcpy(job->executable, executable);
+    return true;
+}
+
+bool JobIsPathStable(const VM *vm, const char *path, size_t length)
+{
+    const VMBase *base;
+    size_t i;
+
+    if (!vm->base.parent)
+    {
+        return true;
+    }
+    if (VFilelistOverlaps(vm->skippedFiles, path, length))
+    {
+        return false;
+    }
+    for (base = vm->base.parent; base; base = base->parent)
+    {
+        const Job *job = base->fullVM ? ((const VM*)base)->job : null;
+        if (job && (job->state == JOB_QUEUED || job->state == JOB_WAITING) &&
+            VFilelistOverlaps(job->modifiedFiles, path, length))
+        {
+            return false;
+        }
+    }
+    for (i = 0; i < jobCount(); i++)
+    {
+        const Job *job = getJob(i);
+        if (job->state == JOB_RUNNING && VFilelistOverlaps(job->modifiedFiles, path, length))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void JobSchedule(bool settled)
+{
+    size_t i;
+    size_t j;
+    uint pass;
+    Job *job;
+
+    /* Jobs of the master VM are started before speculative ones, as everything else depends on
+       them. Among the rest, the jobs of the steps that took longest last time go first, so that
+       they don't end up running alone at the end. Stop when the machine is too loaded to start
+       more processes. */
+    throttled = false;
+    partsDiscarded = false;
+    for (pass = 0; pass < (settled || !running ? 2u : 1u); pass++)
+    {
+        /* The pass is repeated if jobs added parts, so that they are started as well. */
+        partsAdded = false;
+        BVSetSize(&startOrder, 0);
+        for (i = 0; i < jobCount(); i++)
+        {
+            job = getJob(i);
+            if (job->state != JOB_QUEUED || (job->vm->base.parent != null) != (pass == 1) ||
+                (pass == 1 && job->leader) || job->fdIn >= 0 || !canStart(job))
+            {
+                continue;
+            }
+            /* Keep the order jobs were added in for equal priorities. */
+            j = BVSize(&startOrder);
+            while (j && (*(Job**)BVGetPointer(&startOrder, j - sizeof(Job*)))->priority <
+                   job->priority)
+            {
+                j -= sizeof(Job*);
+            }
+            BVInsertData(&startOrder, j, (const byte*)&job, sizeof(job));
+        }
+        /* Jobs following another job don't need a job slot. Stop if jobs in startOrder may have
+           been removed. */
+        for (i = 0; i < BVSize(&startOrder) && !throttled && !partsDiscarded; i += sizeof(Job*))
+        {
+            job = *(Job**)BVGetPointer(&startOrder, i);
+            if (!followJob(job))
+            {
+                if (running >= maxRunning)
+                {
+                    break;
+                }
+                startJob(job);
+            }
+        }
+        if (partsAdded && !throttled && !partsDiscarded)
+        {
+            pass--;
+        }
+    }
+}
+
+bool JobWait(void)
+{
+    if (!running && !runningTasks)
+    {
+        return false;
+    }
+    while (!finishJobs())
+    {
+        int timeout = waitTimeout();
+        if (throttled)
+        {
+            /* Return to let JobSchedule try again. */
+            PipeProcess(timeout < 0 ? THROTTLE_INTERVAL : min(timeout, THROTTLE_INTERVAL));
+            break;
+        }
+        PipeProcess(timeout);
+    }
+    return true;
+}
+
+void JobPoll(void)
+{
+    if (running || runningTasks)
     {
-        /* TODO: This will not happen until job is done in parallel. */
-        unreachable;
+        PipeProcess(0);
     }
+    finishJobs();
 }
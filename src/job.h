@@ -2,17 +2,173 @@ struct _Job;
 
 typedef vref (*JobFunction)(struct _Job*, vref*);
 
+/* Resources used by a process, from wait4. */
+typedef struct
+{
+    ulong userTime; /* ms */
+    ulong systemTime; /* ms */
+    ulong maxRSS; /* kB */
+    ulong blockInput; /* Block input operations. */
+    ulong blockOutput;
+    ulong voluntarySwitches; /* Context switches from waiting, typically for I/O. */
+    ulong involuntarySwitches; /* Context switches from being preempted. */
+} JobUsage;
+
+typedef enum
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_WAITING, /* Waiting for the jobs added with JobAddPart. */
+    JOB_FINISHED
+} JobState;
+
+/*
+  A job is started by calling function. It either returns the result directly, fails the VM, or
+  starts a process and sets state to JOB_RUNNING. If none of that happens (e.g. because the
+  arguments aren't known yet), the job stays queued and function will be called again later.
+
+  When a process has been started, finish is called to create the result once the process has
+  exited and all output has been read, and the job belongs to the master VM. Jobs of
+  speculatively executing VMs only run if they can't have side effects outside of the cache
+  directory. Their output is echoed and their result delivered once the master VM catches up, also
+  when function returned the result directly.
+
+  A job with the same function and arguments as a job that has started a process follows that job
+  instead of starting another process, and gets the same result. If the job followed is
+  discarded, one of its followers takes over the process. A job of the master VM always takes
+  over the process, since speculatively executing VMs can't finish before it does.
+
+  Instead of starting a process, function may add parts with JobAddPart and set state to
+  JOB_WAITING. The parts are scheduled like other jobs. When all of them have finished, the job
+  gets a list of their results.
+
+  A part with fdIn set reads the output of the part added before it, and is started together with
+  that part instead of being scheduled on its own, since the writer would block without a reader.
+
+  A job can also run a task on a thread instead of a process, see JobAddTask.
+*/
 typedef struct _Job
 {
     JobFunction function;
+    JobFunction finish;
     VM *vm;
     vref accessedFiles;
     vref modifiedFiles;
     uint argumentCount;
-    int storeAt;
+    int storeAt; /* For parts, the index of the result in the list. */
+    JobState state;
+    int pid;
+    int worker; /* From WorkerStart if the process runs on a worker, or -1. */
+    int task; /* From TaskStart if the job runs a task instead of a process, or -1. */
+    void *taskData; /* Given to the task function. Freed along with the job. */
+    int exitWatch; /* From PipeWatchProcess. */
+    int status;
+    int pipeIn;
+    int pipeOut;
+    int pipeErr;
+    int fdIn; /* Given to the process as stdin instead of a pipe, if set. Closed when started. */
+    int fdOut; /* Given to the process as stdout instead of a pipe, if set. Closed when started. */
+    bool echoOut; /* Echo output from pipeOut once the job belongs to the master VM. */
+    bool echoErr;
+    ulong killTime; /* When a discarded job that is still running gets SIGKILL. */
+    char *executable; /* Set by JobAdmitProcess. */
+    uint pool; /* 1 + index of the pool the process was admitted to, or 0. */
+    int token; /* From JobserverAcquire. */
+    char *tracePath; /* From TraceCreate, if the files the process reads are traced. */
+    ulong priority; /* Estimated duration (ms) of the step the job belongs to. */
+    ulong startTime;
+    ulong duration; /* Wall-clock time (ms) the process ran. */
+    JobUsage usage; /* Set when the process has been reaped. */
+    struct _Job *leader; /* The job whose process this queued job waits for. */
+    vref result; /* Result of the job this job followed, or returned by function for a
+                    speculatively executing VM. */
+    bool hashed; /* Set when digest has been computed from the arguments. */
+    byte digest[DIGEST_SIZE];
+    struct _Job *group; /* The job this job is a part of. */
+    vref *partResults;
+    uint partCount;
 } Job;
 
+/*
+  By default, output is echoed in program order: the output of a job is echoed while it runs once
+  it belongs to the master VM, and output of speculatively started jobs is kept until then. If
+  outputOnCompletion is true, the stdout and then the stderr of each job is echoed whole as soon as
+  it has finished instead, also for jobs of speculatively executing VMs.
+*/
+void JobInit(uint maxRunningJobs, bool outputOnCompletion);
+void JobDispose(void);
+
+/*
+  Discarded jobs that are still running are stopped with SIGTERM, followed by SIGKILL if they
+  haven't exited after a grace period. They are reaped by JobPoll and JobWait.
+*/
 nonnull Job *JobAdd(JobFunction function, VM *vm, const vref *arguments, uint argumentCount,
                       vref accessedFiles, vref modifiedFiles);
 nonnull void JobDiscard(Job *job);
-void JobExecute(Job *job);
+
+/*
+  Adds a job that runs function on a thread (see task.h) instead of a process, and starts it right
+  away, as tasks don't take job slots. data is given to function, and finish creates the result
+  once it has returned, with status set to what it returned. A task can't be stopped, so a
+  discarded job still waits for it to finish before freeing data.
+*/
+nonnull Job *JobAddTask(int (*function)(void*), void *data, JobFunction finish, VM *vm,
+                        const vref *arguments, uint argumentCount, vref accessedFiles,
+                        vref modifiedFiles);
+
+/*
+  Adds a part to a job. The part accesses and modifies the same files as the job. In program
+  order output mode, the output of parts is echoed one part at a time, in the order they were
+  added. The job function must set state to JOB_WAITING after adding all parts.
+*/
+nonnull Job *JobAddPart(Job *group, JobFunction function, const vref *arguments,
+                        uint argumentCount);
+
+/*
+  Prints the processes run so far to stderr, grouped by executable with the longest running first:
+  how many were run, their total wall-clock, user and system time, the largest max RSS, total block
+  I/O and context switches. Processes of discarded jobs are not included.
+*/
+void JobPrintReport(void);
+
+/*
+  Declares a pool of which at most depth processes may run at a time, in addition to the limit on
+  the total number of running jobs. Declaring a pool again changes its depth.
+*/
+void JobSetPool(vref name, uint depth);
+
+/*
+  Called by job functions before starting a process in pool, which is VNull or the name of a pool.
+  Returns false if the machine is too loaded, no jobserver slot is free, or the pool is full to
+  start it now, in which case the job should stay queued. Also returns false after failing the VM
+  if the pool hasn't been declared. A part with fdIn set is always admitted, as it has to start
+  together with the part writing to it. A process that runs on a worker (remote) only has to fit
+  in the pool, since it doesn't load this machine.
+*/
+nonnull bool JobAdmitProcess(Job *job, const char *executable, vref pool, bool remote);
+
+/*
+  Returns true if the file at path can't be modified by side effects preceding the current
+  position of the VM. That is, by unfinished jobs of parent VMs, other running jobs, or side
+  effects the VM has skipped.
+*/
+nonnull bool JobIsPathStable(const VM *vm, const char *path, size_t length);
+
+/*
+  Starts queued jobs until all job slots are in use. Unless no jobs are running, jobs of
+  speculatively executing VMs are only started when settled is true, meaning all VMs are waiting.
+  By then the queue holds all jobs speculation can find, and the longest ones can be picked.
+*/
+void JobSchedule(bool settled);
+
+/*
+  Waits until at least one running job has finished. The result is delivered to the VM that owns
+  the job. If jobs were held back by JobAdmitProcess, returns after a while even if no job has
+  finished, so that they can be tried again. Returns false if no job is running.
+*/
+bool JobWait(void);
+
+/*
+  Delivers the results of running jobs that have finished, without waiting for any other job.
+*/
+void JobPoll(void);
@@ -0,0 +1,257 @@
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "env.h"
+#include "jobserver.h"
+
+static int readFD = -1; /* Non-blocking, used for taking tokens. */
+static int writeFD = -1; /* Used for returning tokens. */
+static bool joined;
+static int serverPipe[2] = {-1, -1};
+/* The pipe named in MAKEFLAGS, which is only inherited by processes started as clients. */
+static int clientFDs[2] = {-1, -1};
+static char *fifoPath;
+
+
+/*
+  Opens the pipe again, to get a non-blocking file description of it without affecting the other
+  processes using it.
+*/
+static int openNonBlocking(int fd)
+{
+    char path[32];
+    sprintf(path, "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static bool isFifo(int fd)
+{
+    struct stat s;
+    return fd >= 0 && !fstat(fd, &s) && S_ISFIFO(s.st_mode);
+}
+
+/* Returns the value of the last jobserver option in flags, preferring the newer name. */
+static const char *findAuth(const char *flags, size_t *length)
+{
+    static const char *const options[] = {"--jobserver-auth=", "--jobserver-fds="};
+    const char *auth = null;
+    const char *p;
+    uint i;
+
+    for (i = 0; i < sizeof(options) / sizeof(*options) && !auth; i++)
+    {
+        for (p = strstr(flags, options[i]); p; p = strstr(p + 1, options[i]))
+        {
+            auth = p + strlen(options[i]);
+        }
+    }
+    if (auth)
+    {
+        *length = strcspn(auth, " ");
+    }
+    return auth;
+}
+
+static void closeServerPipe(void)
+{
+    if (serverPipe[0] >= 0)
+    {
+        close(serverPipe[0]);
+        close(serverPipe[1]);
+        serverPipe[0] = serverPipe[1] = -1;
+    }
+}
+
+static void setCloseOnExec(int fd)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+void JobserverInit(void)
+{
+    const char *flags = getenv("MAKEFLAGS");
+    const char *auth = null;
+    size_t length = 0;
+    int fdRead;
+    int fdWrite;
+    char *path;
+
+    if (flags)
+    {
+        auth = findAuth(flags, &length);
+    }
+    if (auth && length > 5 && !strncmp(auth, "fifo:", 5))
+    {
+        path = (char*)malloc(length - 4);
+        memcpy(path, auth + 5, length - 5);
+        path[length - 5] = 0;
+        readFD = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        writeFD = readFD;
+        free(path);
+    }
+    /* make closes the pipe for commands it doesn't consider recursive. */
+    else if (auth && sscanf(auth, "%d,%d", &fdRead, &fdWrite) == 2 &&
+             isFifo(fdRead) && isFifo(fdWrite))
+    {
+        readFD = openNonBlocking(fdRead);
+        writeFD = readFD >= 0 ? fdWrite : -1;
+        if (readFD >= 0)
+        {
+            setCloseOnExec(fdRead);
+            setCloseOnExec(fdWrite);
+            clientFDs[0] = fdRead;
+            clientFDs[1] = fdWrite;
+        }
+    }
+    if (readFD >= 0)
+    {
+        joined = true;
+        return;
+    }
+    /* Created already, so that the spawn helper inherits it if don becomes the jobserver. */
+#if HAVE_PIPE2
+    if (pipe2(serverPipe, O_CLOEXEC))
+    {
+        serverPipe[0] = serverPipe[1] = -1;
+    }
+#else
+    if (pipe(serverPipe))
+    {
+        serverPipe[0] = serverPipe[1] = -1;
+    }
+    else
+    {
+        setCloseOnExec(serverPipe[0]);
+        setCloseOnExec(serverPipe[1]);
+    }
+#endif
+}
+
+void JobserverStart(JobserverStyle style, uint jobs)
+{
+    const char *tmp;
+    char *flags;
+    uint i;
+
+    if (joined)
+    {
+        return;
+    }
+    if (style == JOBSERVER_PIPE && serverPipe[0] >= 0)
+    {
+        readFD = openNonBlocking(serverPipe[0]);
+        writeFD = serverPipe[1];
+        clientFDs[0] = serverPipe[0];
+        clientFDs[1] = serverPipe[1];
+    }
+    else if (style == JOBSERVER_FIFO)
+    {
+        closeServerPipe();
+        tmp = getenv("TMPDIR");
+        tmp = tmp && *tmp ? tmp : "/tmp";
+        fifoPath = (char*)malloc(strlen(tmp) + 32);
+        sprintf(fifoPath, "%s/don-jobserver-%ld", tmp, (long)getpid());
+        if (!mkfifo(fifoPath, 0600))
+        {
+            readFD = open(fifoPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            writeFD = readFD;
+        }
+    }
+    if (readFD < 0)
+    {
+        JobserverDispose();
+        return;
+    }
+
+    /* don has one job slot without a token. */
+    for (i = 1; i < jobs; i++)
+    {
+        if (write(writeFD, "+", 1) != 1)
+        {
+            break;
+        }
+    }
+    if (fifoPath)
+    {
+        flags = (char*)malloc(strlen(fifoPath) + 64);
+        sprintf(flags, " -j%u --jobserver-auth=fifo:%s", jobs, fifoPath);
+    }
+    else
+    {
+        /* --jobserver-fds is understood by make before 4.2. */
+        flags = (char*)malloc(96);
+        sprintf(flags, " -j%u --jobserver-fds=%d,%d --jobserver-auth=%d,%d", jobs,
+                serverPipe[0], serverPipe[1], serverPipe[0], serverPipe[1]);
+    }
+    EnvSet("MAKEFLAGS", flags);
+    free(flags);
+}
+
+void JobserverDispose(void)
+{
+    if (readFD >= 0)
+    {
+        close(readFD);
+        readFD = writeFD = -1;
+    }
+    clientFDs[0] = clientFDs[1] = -1;
+    closeServerPipe();
+    if (fifoPath)
+    {
+        unlink(fifoPath);
+        free(fifoPath);
+        fifoPath = null;
+    }
+}
+
+bool JobserverAcquire(uint running, int *token)
+{
+    byte c;
+    ssize_t size;
+
+    *token = -1;
+    if (readFD < 0 || !running)
+    {
+        return true;
+    }
+    do
+    {
+        size = read(readFD, &c, 1);
+    }
+    while (size < 0 && errno == EINTR);
+    if (size != 1)
+    {
+        return false;
+    }
+    *token = c;
+    return true;
+}
+
+bool JobserverGetClientFDs(int *fdRead, int *fdWrite)
+{
+    *fdRead = clientFDs[0];
+    *fdWrite = clientFDs[1];
+    return clientFDs[0] >= 0;
+}
+
+void JobserverRelease(int token)
+{
+    byte c = (byte)token;
+    ssize_t size;
+
+    if (token < 0 || writeFD < 0)
+    {
+        return;
+    }
+    do
+    {
+        size = write(writeFD, &c, 1);
+    }
+    while (size < 0 && errno == EINTR);
+}
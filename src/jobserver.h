@@ -0,0 +1,38 @@
+typedef enum
+{
+    JOBSERVER_NONE,
+    JOBSERVER_PIPE,
+    JOBSERVER_FIFO
+} JobserverStyle;
+
+/*
+  Joins the GNU make jobserver named in MAKEFLAGS, if there is one that is usable. Should be called
+  before SpawnInit, so that the spawn helper keeps the file descriptors of the jobserver open for
+  the processes it starts. They are close-on-exec, so that only processes started as jobserver
+  clients inherit them.
+*/
+void JobserverInit(void);
+
+/*
+  Unless don has joined a jobserver, makes it the jobserver for the processes it starts, with the
+  given number of job slots. Processes get the jobserver through MAKEFLAGS, so EnvInit must have
+  been called.
+*/
+void JobserverStart(JobserverStyle style, uint jobs);
+void JobserverDispose(void);
+
+/*
+  Takes a job slot for a process. running is the number of processes don is already running. If it
+  is zero, the process uses the slot don has implicitly. Returns false if no slot is free. Sets
+  token to what should be passed to JobserverRelease when the process has exited, or -1 if there
+  is nothing to release.
+*/
+nonnull bool JobserverAcquire(uint running, int *token);
+void JobserverRelease(int token);
+
+/*
+  Sets fdRead and fdWrite to the pipe named in MAKEFLAGS, which processes started as jobserver
+  clients must inherit. Returns false if they don't need to inherit anything, as when the
+  jobserver is a fifo.
+*/
+nonnull bool JobserverGetClientFDs(int *fdRead, int *fdWrite);
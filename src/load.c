@@ -0,0 +1,183 @@
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "bytevector.h"
+#include "load.h"
+#include "util.h"
+
+/* Milliseconds between reads of /proc/loadavg and /proc/meminfo. */
+#define REFRESH_INTERVAL 100
+
+typedef struct
+{
+    char *executable;
+    ulong peakMemory;
+} Estimate;
+
+static bytevector estimates;
+static ulong maxRunnableCount;
+static ulong lastRefresh;
+static bool refreshed;
+static ulong runnable; /* Processes ready to run, not counting don. */
+static bool haveRunnable;
+static ulong memoryTotal; /* kB */
+static ulong memoryAvailable; /* kB */
+static bool haveMemory;
+static ulong memoryCommitted; /* kB estimated to be used by processes started since refresh */
+
+
+static void readLoadAverage(void)
+{
+    FILE *f = fopen("/proc/loadavg", "r");
+    ulong value;
+
+    haveRunnable = false;
+    if (!f)
+    {
+        return;
+    }
+    if (fscanf(f, "%*f %*f %*f %lu/", &value) == 1 && value)
+    {
+        runnable = value - 1;
+        haveRunnable = true;
+    }
+    fclose(f);
+}
+
+static void readMemoryInfo(void)
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[128];
+    ulong value;
+    bool haveTotal = false;
+
+    haveMemory = false;
+    if (!f)
+    {
+        return;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "MemTotal: %lu kB", &value) == 1)
+        {
+            memoryTotal = value;
+            haveTotal = true;
+        }
+        else if (sscanf(line, "MemAvailable: %lu kB", &value) == 1)
+        {
+            memoryAvailable = value;
+            haveMemory = true;
+        }
+    }
+    haveMemory = haveMemory && haveTotal;
+    fclose(f);
+}
+
+static void refresh(void)
+{
+    ulong time = UtilTimeMillis();
+    if (refreshed && time - lastRefresh < REFRESH_INTERVAL)
+    {
+        return;
+    }
+    refreshed = true;
+    lastRefresh = time;
+    memoryCommitted = 0;
+    readLoadAverage();
+    readMemoryInfo();
+}
+
+static Estimate *getEstimate(const char *executable)
+{
+    Estimate *e = (Estimate*)BVGetPointer(&estimates, 0);
+    Estimate *stop = (Estimate*)((byte*)e + BVSize(&estimates));
+    for (; e < stop; e++)
+    {
+        if (!strcmp(e->executable, executable))
+        {
+            return e;
+        }
+    }
+    return null;
+}
+
+
+void LoadInit(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    maxRunnableCount = count > 0 ? (ulong)count + 1 : 2;
+    BVInit(&estimates, 16 * sizeof(Estimate));
+}
+
+void LoadDispose(void)
+{
+    Estimate *e = (Estimate*)BVGetPointer(&estimates, 0);
+    Estimate *stop = (Estimate*)((byte*)e + BVSize(&estimates));
+    for (; e < stop; e++)
+    {
+        free(e->executable);
+    }
+    BVDispose(&estimates);
+}
+
+void LoadSetLimit(ulong maxRunnable)
+{
+    maxRunnableCount = maxRunnable;
+}
+
+bool LoadAdmit(const char *executable, uint running)
+{
+    const Estimate *estimate;
+    ulong memory;
+
+    if (!running)
+    {
+        return true;
+    }
+    if (!maxRunnableCount)
+    {
+        return false;
+    }
+    refresh();
+    /* The machine is saturated when processes have to wait for a processor. */
+    if (haveRunnable && runnable >= maxRunnableCount)
+    {
+        return false;
+    }
+    if (!haveMemory)
+    {
+        runnable++;
+        return true;
+    }
+    /* Keep some memory for the page cache. */
+    if (memoryAvailable < memoryTotal / 20)
+    {
+        return false;
+    }
+    estimate = getEstimate(executable);
+    memory = estimate ? estimate->peakMemory : 0;
+    if (memoryCommitted + memory > memoryAvailable - memoryTotal / 20)
+    {
+        return false;
+    }
+    /* Processes started since the last refresh aren't visible in /proc until they are running. */
+    runnable++;
+    memoryCommitted += memory;
+    return true;
+}
+
+void LoadRecordPeakMemory(const char *executable, ulong kilobytes)
+{
+    Estimate *estimate = getEstimate(executable);
+    if (!estimate)
+    {
+        estimate = (Estimate*)BVGetAppendPointer(&estimates, sizeof(Estimate));
+        estimate->executable = (char*)malloc(strlen(executable) + 1);
+        strcpy(estimate->executable, executable);
+        estimate->peakMemory = kilobytes;
+        return;
+    }
+    estimate->peakMemory = max(estimate->peakMemory, kilobytes);
+}
@@ -0,0 +1,21 @@
+void LoadInit(void);
+void LoadDispose(void);
+
+/*
+  Sets how many processes may be ready to run before no more are started. The default is one more
+  than the number of processors. With 0, don runs one process at a time.
+*/
+void LoadSetLimit(ulong maxRunnable);
+
+/*
+  Returns true if a process of the executable can be started without overloading the machine.
+  Considers the number of processes ready to run, available memory, and the peak memory use
+  of earlier processes of the same executable. running is the number of processes don is already
+  running. If it is zero, the process is always allowed to start.
+*/
+nonnull bool LoadAdmit(const char *executable, uint running);
+
+/*
+  Records the peak memory use (in kB) of a finished process of the executable.
+*/
+nonnull void LoadRecordPeakMemory(const char *executable, ulong kilobytes);
@@ -9,20 +9,29 @@
 #include "env.h"
 #include "fail.h"
 #include "file.h"
+#include "hash.h"
 #include "heap.h"
 #include "interpreter.h"
 #include "intvector.h"
+#include "job.h"
+#include "jobserver.h"
 #include "linker.h"
+#include "load.h"
 #include "log.h"
 #include "main.h"
 #include "namespace.h"
 #include "native.h"
 #include "parser.h"
 #include "pipe.h"
+#include "spawn.h"
 #include "stringpool.h"
+#include "task.h"
+#include "trace.h"
+#include "worker.h"
 
 
 static intvector targets;
+static bool jobReport;
 
 
 int main(int argc, const char **argv)
@@ -31,6 +40,8 @@ int main(int argc, const char **argv)
     uint j;
     const char *options;
     const char *inputFilename = null;
+    const char *workerAddress = null;
+    const char *workerAddresses = null;
     const char *env;
     size_t envLength;
     const char *cacheDirectory;
@@ -39,10 +50,18 @@ int main(int argc, const char **argv)
     namespaceref defaultNamespace;
     vref name;
     bool parseOptions = true;
+    bool outputOnCompletion = false;
+    bool keepGoing = false;
+    JobserverStyle jobserverStyle = JOBSERVER_PIPE;
     bool fail;
+    long jobCount = 0;
+    long maxLoad = -1;
+    char *end;
     ParsedProgram parsed;
     LinkedProgram linked;
 
+    JobserverInit();
+    PipeInit();
     IVInit(&targets, 4);
     LogInit();
     HeapInit();
@@ -64,8 +83,48 @@ int main(int argc, const char **argv)
             {
                 if (*++options)
                 {
-                    fputs("TODO: Long option\n", stderr);
-                    return 1;
+                    if (!strcmp(options, "output-order=program"))
+                    {
+                        outputOnCompletion = false;
+                    }
+                    else if (!strcmp(options, "output-order=completion"))
+                    {
+                        outputOnCompletion = true;
+                    }
+                    else if (!strcmp(options, "job-report"))
+                    {
+                        jobReport = true;
+                    }
+                    else if (!strcmp(options, "keep-going"))
+                    {
+                        keepGoing = true;
+                    }
+                    else if (!strcmp(options, "jobserver=pipe"))
+                    {
+                        jobserverStyle = JOBSERVER_PIPE;
+                    }
+                    else if (!strcmp(options, "jobserver=fifo"))
+                    {
+                        jobserverStyle = JOBSERVER_FIFO;
+                    }
+                    else if (!strcmp(options, "jobserver=none"))
+                    {
+                        jobserverStyle = JOBSERVER_NONE;
+                    }
+                    else if (!strncmp(options, "worker=", 7) && options[7])
+                    {
+                        workerAddress = options + 7;
+                    }
+                    else if (!strncmp(options, "workers=", 8) && options[8])
+                    {
+                        workerAddresses = options + 8;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "Unknown option: --%s\n", options);
+                        return 1;
+                    }
+                    continue;
                 }
                 else
                 {
@@ -90,6 +149,38 @@ int main(int argc, const char **argv)
                     inputFilename = argv[i];
                     break;
 
+                case 'j':
+                    if (++i >= argc)
+                    {
+                        fputs("Option \"-j\" requires an argument.\n", stderr);
+                        return 1;
+                    }
+                    jobCount = strtol(argv[i], &end, 10);
+                    if (*end || jobCount <= 0 || jobCount > INT_MAX)
+                    {
+                        fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                        return 1;
+                    }
+                    break;
+
+                case 'k':
+                    keepGoing = true;
+                    break;
+
+                case 'l':
+                    if (++i >= argc)
+                    {
+                        fputs("Option \"-l\" requires an argument.\n", stderr);
+                        return 1;
+                    }
+                    maxLoad = strtol(argv[i], &end, 10);
+                    if (*end || !*argv[i] || maxLoad < 0)
+                    {
+                        fprintf(stderr, "Invalid load limit: %s\n", argv[i]);
+                        return 1;
+                    }
+                    break;
+
                 default:
                     fprintf(stderr, "Unknown option: %c\n", argv[i][1]);
                     return 1;
@@ -102,6 +193,10 @@ int main(int argc, const char **argv)
             IVAdd(&targets, intFromRef(name));
         }
     }
+    if (workerAddress)
+    {
+        WorkerServe(workerAddress);
+    }
     if (inputFilename)
     {
         char *slash = strrchr(inputFilename, '/');
@@ -119,9 +214,21 @@ int main(int argc, const char **argv)
     {
         inputFilename = "build.don";
     }
+    /* The spawn helper is forked as early as possible, but after changing directory, as the
+       processes it starts run in its working directory. */
+    SpawnInit();
 
     EnvInit(environ);
     FileInit();
+    if (workerAddresses)
+    {
+        WorkerInit(workerAddresses);
+    }
+    /* Without -j, there is a job for each worker, or else for each processor. */
+    if (!jobCount)
+    {
+        jobCount = WorkerCount() ? (long)WorkerCount() : sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
     EnvGet("XDG_CACHE_HOME", 14, &env, &envLength);
     if (envLength)
@@ -196,13 +303,24 @@ int main(int argc, const char **argv)
     }
     StringPoolDispose();
 
-    PipeInit();
+    LoadInit();
+    if (maxLoad >= 0)
+    {
+        LoadSetLimit((ulong)maxLoad);
+    }
+    JobserverStart(jobserverStyle, jobCount > 0 ? (uint)jobCount : 1);
+    JobInit(jobCount > 0 ? (uint)jobCount : 1, outputOnCompletion);
     CacheInit(cacheDirectory, cacheDirectoryLength, cacheDirectoryDotCache);
+    TraceInit();
+    InterpreterInit(keepGoing);
     for (j = 0; j < IVSize(&targets); j++)
     {
-        InterpreterExecute(
-            &linked, linked.functions[NamespaceGetTarget(defaultNamespace,
-                                                         refFromInt(IVGet(&targets, j)))]);
+        if (!InterpreterExecute(
+                &linked, linked.functions[NamespaceGetTarget(defaultNamespace,
+                                                             refFromInt(IVGet(&targets, j)))]))
+        {
+            fail = true;
+        }
     }
 
 #ifdef VALGRIND
@@ -212,6 +330,13 @@ int main(int argc, const char **argv)
     free(linked.constants);
     free(linked.fields);
 #endif
+    if (fail)
+    {
+        /* Output of other jobs may have come after the failures, so list them again. */
+        fputs("Failures:\n", stderr);
+        InterpreterPrintFailures();
+        cleanShutdown(EXIT_FAILURE);
+    }
     cleanShutdown(EXIT_SUCCESS);
 }
 
@@ -224,6 +349,19 @@ void cleanShutdown(int exitcode)
     }
     shuttingDown = true;
     CacheDispose();
+    JobserverDispose();
+    if (jobReport)
+    {
+        JobPrintReport();
+    }
+    if (DEBUG_SPAWN)
+    {
+        SpawnPrintStatistics();
+    }
+    if (DEBUG_INSTRUCTIONS)
+    {
+        InterpreterPrintStatistics();
+    }
 #ifdef VALGRIND
     IVDispose(&targets);
     VDispose();
@@ -232,6 +370,13 @@ void cleanShutdown(int exitcode)
     FileDisposeAll();
     EnvDispose();
     StringPoolDispose();
+    InterpreterDispose();
+    TraceDispose();
+    WorkerDispose();
+    TaskDispose();
+    JobDispose();
+    LoadDispose();
+    SpawnDispose();
     PipeDisposeAll();
     LogDispose();
 #endif
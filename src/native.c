@@ -1,7 +1,6 @@
 #include "config.h"
-#if USE_POSIX_SPAWN
-#include <spawn.h>
-#endif
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
@@ -18,12 +17,20 @@
 #include "log.h"
 #include "native.h"
 #include "pipe.h"
+#include "spawn.h"
 #include "std.h"
 #include "stringpool.h"
+#include "task.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
+#include "worker.h"
+
+#define NATIVE_FUNCTION_COUNT 27
 
-#define NATIVE_FUNCTION_COUNT 22
+/* Files smaller than this are read, written and copied right away rather than on a task thread,
+   which costs more than it saves for them. */
+#define TASK_MIN_SIZE ((size_t)1024 * 1024)
 
 typedef vref (*invoke)(VM*);
 
@@ -35,6 +42,34 @@ typedef struct
     uint returnValueCount;
 } FunctionInfo;
 
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t size;
+    vref string;
+} ReadTask;
+
+typedef struct
+{
+    int fd;
+    const char *data;
+    size_t size;
+    char *copy; /* Freed by the task, if the string isn't stored in one piece. */
+} WriteTask;
+
+typedef struct
+{
+    int fd;
+    char *path; /* Stored after the struct. */
+} DeleteTask;
+
+typedef struct
+{
+    int srcfd;
+    int dstfd;
+} CopyTask;
+
 static FunctionInfo functionInfo[NATIVE_FUNCTION_COUNT];
 static uint initFunctionIndex = 1;
 
@@ -118,14 +153,27 @@ static char **createStringArray(vref collection)
     return strings;
 }
 
+static vref readOpenFile(File *file, size_t size)
+{
+    vref string;
+    char *data;
+
+    if (!size)
+    {
+        FileClose(file);
+        return VEmptyString;
+    }
+    string = VCreateUninitialisedString(size, &data);
+    FileRead(file, (byte*)data, size);
+    FileClose(file);
+    return string;
+}
+
 static vref readFile(vref object, vref valueIfNotExists)
 {
     const char *path;
     size_t pathLength;
     File file;
-    vref string;
-    char *data;
-    size_t size;
 
     path = VGetPath(object, &pathLength);
     if (valueIfNotExists)
@@ -139,89 +187,180 @@ static vref readFile(vref object, vref valueIfNotExists)
     {
         FileOpen(&file, path, pathLength);
     }
-    size = FileSize(&file);
-    if (!size)
-    {
-        FileClose(&file);
-        return VEmptyString;
-    }
-    string = VCreateUninitialisedString(size, &data);
-    FileRead(&file, (byte*)data, size);
-    FileClose(&file);
-    return string;
+    return readOpenFile(&file, FileSize(&file));
 }
 
-static int startProcess(const char *executable, char *const argv[],
-                        const char *const envp[], int fdIn, int fdOut, int fdErr)
+static int readTask(void *data)
 {
-    pid_t pid;
-    int status;
-#if USE_POSIX_SPAWN
-    posix_spawn_file_actions_t psfa;
-    posix_spawn_file_actions_init(&psfa);
-    if (fdIn != STDIN_FILENO)
-    {
-        posix_spawn_file_actions_adddup2(&psfa, fdIn, STDIN_FILENO);
-    }
-    posix_spawn_file_actions_adddup2(&psfa, fdOut, STDOUT_FILENO);
-    posix_spawn_file_actions_adddup2(&psfa, fdErr, STDERR_FILENO);
-    status = posix_spawn(&pid, executable, &psfa, null, argv, (char*const*)envp);
-    posix_spawn_file_actions_destroy(&psfa);
-    if (unlikely(status))
-    {
-        FailErrno(false);
-    }
-#else
-    pid = VFORK();
-    if (!pid)
+    ReadTask *task = (ReadTask*)data;
+    char *p = task->data;
+    size_t size = task->size;
+    ssize_t sizeRead;
+    int error = 0;
+
+    while (size)
     {
-        if (fdIn != STDIN_FILENO)
+        sizeRead = read(task->fd, p, size);
+        if (sizeRead <= 0)
         {
-            status = dup2(fdIn, STDIN_FILENO);
-            if (unlikely(status == -1))
+            if (sizeRead < 0 && errno == EINTR)
             {
-                FailErrno(true);
+                continue;
             }
+            /* Nothing left to read means the file has been truncated. */
+            error = sizeRead ? errno : EIO;
+            break;
         }
-        status = dup2(fdOut, STDOUT_FILENO);
-        if (unlikely(status == -1))
+        p += sizeRead;
+        size -= (size_t)sizeRead;
+    }
+    close(task->fd);
+    return error;
+}
+
+static int writeTask(void *data)
+{
+    WriteTask *task = (WriteTask*)data;
+    const char *p = task->data;
+    size_t size = task->size;
+    ssize_t written;
+    int error = 0;
+
+    while (size)
+    {
+        written = write(task->fd, p, size);
+        if (written < 0)
         {
-            FailErrno(true);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error = errno;
+            break;
         }
-        status = dup2(fdErr, STDERR_FILENO);
-        if (unlikely(status == -1))
+        p += written;
+        size -= (size_t)written;
+    }
+    close(task->fd);
+    free(task->copy);
+    return error;
+}
+
+static int deleteTask(void *data)
+{
+    DeleteTask *task = (DeleteTask*)data;
+    return FileDeleteDirectory(task->path, task->fd);
+}
+
+static int copyTask(void *data)
+{
+    CopyTask *task = (CopyTask*)data;
+    return FileCopyData(task->srcfd, task->dstfd);
+}
+
+/* Fails with message if the task of job failed. The path is that of the first argument. */
+static void checkTask(const Job *job, const vref *values, const char *message)
+{
+    const char *path;
+    size_t length;
+
+    if (unlikely(job->status))
+    {
+        path = VGetPath(values[0], &length);
+        FailIOErrno(message, path, job->status);
+    }
+}
+
+static vref readTaskFinish(Job *job, vref *values)
+{
+    checkTask(job, values, "Cannot read file");
+    return ((ReadTask*)job->taskData)->string;
+}
+
+static vref writeTaskFinish(Job *job, vref *values)
+{
+    checkTask(job, values, "Error writing to file");
+    return VNull;
+}
+
+static vref deleteTaskFinish(Job *job, vref *values)
+{
+    checkTask(job, values, "Error deleting directory");
+    return VNull;
+}
+
+static vref copyTaskFinish(Job *job, vref *values)
+{
+    checkTask(job, values, "Error copying file");
+    return VNull;
+}
+
+static bool isFileStable(const VM *vm, vref file)
+{
+    const char *path;
+    size_t length;
+
+    path = VGetPath(file, &length);
+    return JobIsPathStable(vm, path, length);
+}
+
+static bool areFilesStable(const VM *vm, vref files)
+{
+    size_t index;
+    vref value;
+    for (index = 0; VCollectionGet(files, VBoxSize(index++), &value);)
+    {
+        if (!isFileStable(vm, value))
         {
-            FailErrno(true);
+            return false;
         }
-
-        execve(executable, argv, (char*const*)envp);
-        _exit(EXIT_FAILURE);
     }
-#endif
-    return pid;
+    return true;
 }
 
 
 static vref nativeCp(VM *vm)
 {
-    vref src = VMReadValue(vm);
-    vref dst = VMReadValue(vm);
+    vref arguments[2];
     const char *srcPath;
     const char *dstPath;
     size_t srcLength;
     size_t dstLength;
+    int srcfd;
+    int dstfd;
+    size_t size;
+    int error;
+    CopyTask *task;
 
-    if (src == VFuture || dst == VFuture || vm->base.parent)
+    arguments[0] = VMReadValue(vm);
+    arguments[1] = VMReadValue(vm);
+    if (vm->base.parent)
     {
-        /* TODO */
-        vm->idle = true;
+        VMSkipModification(vm, arguments[1]);
         return 0;
     }
-
-    srcPath = VGetPath(src, &srcLength);
-    dstPath = VGetPath(dst, &dstLength);
-    FileCopy(srcPath, srcLength, dstPath, dstLength);
-    return 0;
+    srcPath = VGetPath(arguments[0], &srcLength);
+    dstPath = VGetPath(arguments[1], &dstLength);
+    if (!FileCopyBegin(srcPath, srcLength, dstPath, dstLength, &srcfd, &dstfd, &size))
+    {
+        return 0;
+    }
+    if (size < TASK_MIN_SIZE)
+    {
+        error = FileCopyData(srcfd, dstfd);
+        if (unlikely(error))
+        {
+            FailIOErrno("Error copying file", srcPath, error);
+        }
+        return 0;
+    }
+    task = (CopyTask*)malloc(sizeof(*task));
+    task->srcfd = srcfd;
+    task->dstfd = dstfd;
+    vm->job = JobAddTask(copyTask, task, copyTaskFinish, vm, arguments, 2,
+                         VCreateArrayFromData(arguments, 1),
+                         VCreateArrayFromData(arguments + 1, 1));
+    return VFuture;
 }
 
 static vref nativeEcho(VM *vm)
@@ -257,6 +396,10 @@ typedef struct
     vref echoOut;
     vref echoErr;
     vref fail;
+    vref pool;
+    vref keepOutput; /* VFalse if the output isn't used, and only needs to be echoed. */
+    vref trace; /* VTrue to trace the files the process reads, if the library is available. */
+    vref jobserver; /* VTrue to let the process use the jobserver. */
 } ExecEnv;
 
 typedef struct
@@ -264,29 +407,132 @@ typedef struct
     vref outputStd;
     vref outputErr;
     vref exitcode;
+    vref usage;
+    vref accessedFiles; /* VNull if the process wasn't traced. */
 } ExecReturn;
 
-static vref jobExec(Job *job, vref *values)
+/* The usage returned by exec: wall-clock, user and system time in milliseconds, max RSS in
+   kilobytes, block input and output operations, voluntary and involuntary context switches. */
+static vref createUsage(const Job *job)
+{
+    vref values[8];
+    values[0] = VBoxSize(job->duration);
+    values[1] = VBoxSize(job->usage.userTime);
+    values[2] = VBoxSize(job->usage.systemTime);
+    values[3] = VBoxSize(job->usage.maxRSS);
+    values[4] = VBoxSize(job->usage.blockInput);
+    values[5] = VBoxSize(job->usage.blockOutput);
+    values[6] = VBoxSize(job->usage.voluntarySwitches);
+    values[7] = VBoxSize(job->usage.involuntarySwitches);
+    return VCreateArrayFromData(values, 8);
+}
+
+/* Opens /dev/null for output that is neither used nor echoed. */
+static int openNull(void)
+{
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (unlikely(fd < 0))
+    {
+        FailErrno(false);
+    }
+    return fd;
+}
+
+/* Returns the output read from pipe, or an empty string if the output wasn't piped. */
+static vref disposeOutput(int pipe)
+{
+    vref value = VEmptyString;
+    if (pipe >= 0)
+    {
+        PipeDispose(pipe, &value);
+    }
+    return value;
+}
+
+/* Returns the stdin of a process run by a worker: the string, or the contents of the file opened
+   as stdinFile. A process that would inherit stdin gets empty stdin. */
+static char *workerStdin(vref stdin, File *stdinFile, size_t *size)
+{
+    char *data;
+
+    if (VIsFile(stdin))
+    {
+        *size = FileSize(stdinFile);
+        data = (char*)malloc(*size + 1);
+        if (*size)
+        {
+            FileRead(stdinFile, (byte*)data, *size);
+        }
+        FileClose(stdinFile);
+        return data;
+    }
+    if (VIsInteger(stdin))
+    {
+        *size = 0;
+        return (char*)calloc(1, 1);
+    }
+    *size = VStringLength(stdin);
+    data = (char*)malloc(*size + 1);
+    VWriteString(stdin, data);
+    return data;
+}
+
+static vref jobExecFinish(Job *job, vref *values)
 {
     ExecEnv *env = (ExecEnv*)values;
     ExecReturn execReturn;
+    int status = job->status;
+
+    if (job->pipeIn >= 0)
+    {
+        PipeDispose(job->pipeIn, null);
+    }
+    if (unlikely(WEXITSTATUS(status)) && VIsTruthy(env->fail))
+    {
+        disposeOutput(job->pipeOut);
+        disposeOutput(job->pipeErr);
+        VMFailf(job->vm, "Process exited with status %d", WEXITSTATUS(status));
+        return 0;
+    }
+    execReturn.exitcode = VBoxInteger(WEXITSTATUS(status));
+    execReturn.usage = createUsage(job);
+    execReturn.outputStd = disposeOutput(job->pipeOut);
+    execReturn.outputErr = disposeOutput(job->pipeErr);
+    execReturn.accessedFiles = VNull;
+    if (job->tracePath)
+    {
+        execReturn.accessedFiles = TraceRead(job->tracePath);
+        job->tracePath = null;
+    }
+    LogAutoNewline();
+    return VCreateArrayFromData((const vref*)&execReturn, 5);
+}
+
+static vref jobExec(Job *job, vref *values)
+{
+    ExecEnv *env = (ExecEnv*)values;
     char *executable;
     vref value;
     char **argv;
     size_t arg0Length;
     const char *const*envp;
+    vref envOverrides;
     size_t index;
     const char *path;
-    pid_t pid;
-    int status;
-    int pipeIn = -1, fdInRead = STDIN_FILENO;
-    int pipeOut, fdOutWrite;
-    int pipeErr, fdErrWrite;
+    const char *data;
+    File stdinFile;
+    int pid;
+    int fdInRead = STDIN_FILENO;
+    int fdOutWrite;
+    int fdErrWrite;
     size_t length;
+    bool remote;
+    char *stdinData;
 
     if (env->command == VFuture || env->stdin == VFuture || env->env == VFuture ||
-        env->echoOut == VFuture || env->echoErr == VFuture ||
-        env->fail == VFuture || job->modifiedFiles == VFuture)
+        env->echoOut == VFuture || env->echoErr == VFuture || env->fail == VFuture ||
+        env->pool == VFuture || env->keepOutput == VFuture || env->trace == VFuture ||
+        env->jobserver == VFuture || job->modifiedFiles == VFuture)
     {
         return 0;
     }
@@ -317,35 +563,138 @@ static vref jobExec(Job *job, vref *values)
         return 0;
     }
 
-    if (!VIsInteger(env->stdin))
+    /* Parts piped to or from another part run here, with the part they are connected to. */
+    remote = WorkerCount() && job->fdIn < 0 && job->fdOut < 0;
+    if (remote && !WorkerIdle())
+    {
+        free(executable);
+        free(argv);
+        return 0;
+    }
+
+    /* A file is given to the process as stdin directly. */
+    if (job->fdIn < 0 && VIsFile(env->stdin))
+    {
+        path = VGetPath(env->stdin, &length);
+        if (!FileTryOpen(&stdinFile, path, length))
+        {
+            VMFailf(job->vm, "File not found: %s", path);
+            free(executable);
+            free(argv);
+            return 0;
+        }
+        fdInRead = stdinFile.fd;
+    }
+
+    if (VIsTruthy(env->trace) && TraceAvailable() && !job->tracePath)
+    {
+        job->tracePath = TraceCreate();
+        if (unlikely(!job->tracePath))
+        {
+            VMFailf(job->vm, "Error creating trace file");
+            if (job->fdIn < 0 && VIsFile(env->stdin))
+            {
+                FileClose(&stdinFile);
+            }
+            free(executable);
+            free(argv);
+            return 0;
+        }
+    }
+
+    if (!JobAdmitProcess(job, executable, env->pool, remote))
+    {
+        if (job->fdIn < 0 && VIsFile(env->stdin))
+        {
+            FileClose(&stdinFile);
+        }
+        free(executable);
+        free(argv);
+        return 0;
+    }
+
+    if (job->fdIn >= 0)
+    {
+        fdInRead = job->fdIn;
+    }
+    else if (!remote && !VIsInteger(env->stdin) && !VIsFile(env->stdin))
     {
-        bytevector *buffer;
         length = VStringLength(env->stdin);
-        pipeIn = PipeCreateRead(&fdInRead, &buffer, length);
-        VWriteString(env->stdin, (char*)BVGetAppendPointer(buffer, length));
+        data = VGetStringData(env->stdin);
+        if (data)
+        {
+            job->pipeIn = PipeCreateReadFrom(&fdInRead, data, length);
+        }
+        else
+        {
+            bytevector *buffer;
+            job->pipeIn = PipeCreateRead(&fdInRead, &buffer, length);
+            VWriteString(env->stdin, (char*)BVGetAppendPointer(buffer, length));
+        }
     }
     else
     {
-        assert(env->stdin == VBoxInteger(0));
+        assert(remote || env->stdin == VBoxInteger(0) || VIsFile(env->stdin));
+    }
+    if (job->fdOut >= 0)
+    {
+        fdOutWrite = job->fdOut;
+    }
+    else if (!VIsTruthy(env->keepOutput) && !VIsTruthy(env->echoOut))
+    {
+        fdOutWrite = openNull();
+    }
+    else
+    {
+        job->pipeOut = PipeCreateWrite(&fdOutWrite);
+        if (!VIsTruthy(env->keepOutput))
+        {
+            PipeDiscard(job->pipeOut);
+        }
+    }
+    if (!VIsTruthy(env->keepOutput) && !VIsTruthy(env->echoErr))
+    {
+        fdErrWrite = openNull();
+    }
+    else
+    {
+        job->pipeErr = PipeCreateWrite(&fdErrWrite);
+        if (!VIsTruthy(env->keepOutput))
+        {
+            PipeDiscard(job->pipeErr);
+        }
     }
-    pipeOut = PipeCreateWrite(&fdOutWrite);
-    pipeErr = PipeCreateWrite(&fdErrWrite);
 
-    envp = VCollectionSize(env->env) ? EnvCreateCopy(env->env) : EnvGetEnv();
+    envOverrides = job->tracePath ? TraceEnv(env->env, job->tracePath) : env->env;
+    envp = VCollectionSize(envOverrides) ? EnvCreateCopy(envOverrides) : EnvGetEnv();
 
-    pid = startProcess(executable, argv, envp, fdInRead, fdOutWrite, fdErrWrite);
+    if (remote)
+    {
+        stdinData = workerStdin(env->stdin, &stdinFile, &length);
+        job->worker = WorkerStart(executable, argv, envp, stdinData, length, fdOutWrite,
+                                  fdErrWrite, job->accessedFiles, job->modifiedFiles);
+        free(stdinData);
+        pid = 0;
+    }
+    else
+    {
+        pid = SpawnProcess(executable, argv, envp, fdInRead, fdOutWrite, fdErrWrite,
+                           VIsTruthy(env->jobserver));
+        if (fdInRead != STDIN_FILENO)
+        {
+            close(fdInRead);
+        }
+        close(fdOutWrite);
+        close(fdErrWrite);
+    }
     free(executable);
     free(argv);
-    if (VCollectionSize(env->env))
+    if (VCollectionSize(envOverrides))
     {
         free((void*)envp);
     }
-    if (pipeIn >= 0)
-    {
-        close(fdInRead);
-    }
-    close(fdOutWrite);
-    close(fdErrWrite);
+    job->fdIn = -1;
+    job->fdOut = -1;
     if (unlikely(pid < 0))
     {
         FailOOM();
@@ -358,44 +707,119 @@ static vref jobExec(Job *job, vref *values)
         FileMarkModified(path, length);
     }
 
-    if (VIsTruthy(env->echoOut))
-    {
-        PipeConnect(pipeOut, STDOUT_FILENO);
-    }
-    if (VIsTruthy(env->echoErr))
-    {
-        PipeConnect(pipeErr, STDOUT_FILENO);
-    }
-    do
+    job->echoOut = job->pipeOut >= 0 && VIsTruthy(env->echoOut);
+    job->echoErr = job->pipeErr >= 0 && VIsTruthy(env->echoErr);
+    job->pid = pid;
+    job->finish = jobExecFinish;
+    job->state = JOB_RUNNING;
+    return 0;
+}
+
+static vref nativeExec(VM *vm)
+{
+    ExecEnv env;
+    vref access, modify;
+
+    env.command = VMReadValue(vm);
+    env.stdin = VMReadValue(vm);
+    env.env = VMReadValue(vm);
+    env.echoOut = VMReadValue(vm);
+    env.echoErr = VMReadValue(vm);
+    env.fail = VMReadValue(vm);
+    env.pool = VMReadValue(vm);
+    env.keepOutput = VMReadValue(vm);
+    env.trace = VMReadValue(vm);
+    env.jobserver = VMReadValue(vm);
+    access = VMReadValue(vm);
+    modify = VMReadValue(vm);
+
+    vm->job = JobAdd(jobExec, vm, (const vref*)&env,
+                     sizeof(ExecEnv) / sizeof(vref), access, modify);
+    return VFuture;
+}
+
+/*
+  Adds a part running each command, with the environment of the job. If connect is true, the
+  stdout of each command is piped to the stdin of the next, and only the first reads stdin.
+*/
+static vref addExecParts(Job *job, vref *values, bool connect)
+{
+    ExecEnv *env = (ExecEnv*)values;
+    ExecEnv partEnv;
+    Job *part;
+    size_t index;
+    vref command;
+    uint count = 0;
+    size_t size = 0;
+    int fd[2];
+    int fdIn = -1;
+
+    if (env->command == VFuture || env->stdin == VFuture || env->env == VFuture ||
+        env->echoOut == VFuture || env->echoErr == VFuture || env->fail == VFuture ||
+        env->pool == VFuture || env->keepOutput == VFuture || env->jobserver == VFuture ||
+        job->modifiedFiles == VFuture)
     {
-        PipeProcess();
+        return 0;
     }
-    while (PipeIsOpen(pipeOut) || PipeIsOpen(pipeErr));
-
-    pid = waitpid(pid, &status, 0);
-    if (unlikely(pid < 0))
+    /* The parts can't be changed once added, so all commands must be known. */
+    if (!addStringsLength(env->command, &count, &size))
     {
-        FailErrno(false);
+        return 0;
     }
-    if (pipeIn >= 0)
+    if (!VCollectionSize(env->command))
     {
-        PipeDispose(pipeIn, null);
+        if (connect)
+        {
+            VMFailf(job->vm, "No commands to pipe");
+            return 0;
+        }
+        return env->command;
     }
-    if (unlikely(WEXITSTATUS(status)) && VIsTruthy(env->fail))
+    partEnv = *env;
+    for (index = 0; VCollectionGet(env->command, VBoxSize(index++), &command);)
     {
-        PipeDispose(pipeOut, null);
-        PipeDispose(pipeErr, null);
-        VMFailf(job->vm, "Process exited with status %d", WEXITSTATUS(status));
-        return 0;
+        partEnv.command = VIsCollection(command) ? command : VCreateArrayFromData(&command, 1);
+        part = JobAddPart(job, jobExec, (const vref*)&partEnv, sizeof(ExecEnv) / sizeof(vref));
+        if (connect)
+        {
+            part->fdIn = fdIn;
+            fdIn = -1;
+            if (index < VCollectionSize(env->command))
+            {
+#if HAVE_PIPE2
+                if (unlikely(pipe2(fd, O_CLOEXEC)))
+                {
+                    FailErrno(false);
+                }
+#else
+                if (unlikely(pipe(fd)))
+                {
+                    FailErrno(false);
+                }
+                fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+                fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+                part->fdOut = fd[1];
+                fdIn = fd[0];
+            }
+            partEnv.stdin = VBoxInteger(0);
+        }
     }
-    execReturn.exitcode = VBoxInteger(WEXITSTATUS(status));
-    PipeDispose(pipeOut, &execReturn.outputStd);
-    PipeDispose(pipeErr, &execReturn.outputErr);
-    LogAutoNewline();
-    return VCreateArrayFromData((const vref*)&execReturn, 3);
+    job->state = JOB_WAITING;
+    return 0;
 }
 
-static vref nativeExec(VM *vm)
+static vref jobExecAll(Job *job, vref *values)
+{
+    return addExecParts(job, values, false);
+}
+
+static vref jobExecPipe(Job *job, vref *values)
+{
+    return addExecParts(job, values, true);
+}
+
+static vref nativeExecAll(VM *vm)
 {
     ExecEnv env;
     vref access, modify;
@@ -406,10 +830,37 @@ static vref nativeExec(VM *vm)
     env.echoOut = VMReadValue(vm);
     env.echoErr = VMReadValue(vm);
     env.fail = VMReadValue(vm);
+    env.pool = VMReadValue(vm);
+    env.keepOutput = VMReadValue(vm);
+    env.trace = VFalse;
+    env.jobserver = VMReadValue(vm);
     access = VMReadValue(vm);
     modify = VMReadValue(vm);
 
-    vm->job = JobAdd(jobExec, vm, (const vref*)&env,
+    vm->job = JobAdd(jobExecAll, vm, (const vref*)&env,
+                     sizeof(ExecEnv) / sizeof(vref), access, modify);
+    return VFuture;
+}
+
+static vref nativeExecPipe(VM *vm)
+{
+    ExecEnv env;
+    vref access, modify;
+
+    env.command = VMReadValue(vm);
+    env.stdin = VMReadValue(vm);
+    env.env = VMReadValue(vm);
+    env.echoOut = VMReadValue(vm);
+    env.echoErr = VMReadValue(vm);
+    env.fail = VMReadValue(vm);
+    env.pool = VMReadValue(vm);
+    env.keepOutput = VMReadValue(vm);
+    env.trace = VFalse;
+    env.jobserver = VMReadValue(vm);
+    access = VMReadValue(vm);
+    modify = VMReadValue(vm);
+
+    vm->job = JobAdd(jobExecPipe, vm, (const vref*)&env,
                      sizeof(ExecEnv) / sizeof(vref), access, modify);
     return VFuture;
 }
@@ -474,18 +925,36 @@ static vref nativeGetCache(VM *vm)
     byte hash[DIGEST_SIZE];
     bool uptodate;
     vref value;
+    vref dependencies;
+    ulong duration;
     GetCacheResult result;
 
-    if (key == VFuture || echoCachedOutput == VFuture ||
-        vm->base.parent) /* TODO */
+    if (key == VFuture || echoCachedOutput == VFuture)
     {
-        vm->idle = true;
-        return 0;
+        return VFuture;
     }
     HashInit(&hashState);
     VHash(key, &hashState);
     HashFinal(&hashState, hash);
-    CacheGet(hash, VIsTruthy(echoCachedOutput), &uptodate, &result.cacheFile, &value);
+    if (!vm->base.parent)
+    {
+        CacheGet(hash, VIsTruthy(echoCachedOutput), &uptodate, &result.cacheFile, &value, null,
+                 &duration);
+    }
+    else
+    {
+        /* The cached output is echoed once the master VM gets here. */
+        CacheGet(hash, false, &uptodate, &result.cacheFile, &value, &dependencies, &duration);
+    }
+    vm->stepEstimate = duration;
+    vm->stepTime = 0;
+    if (vm->base.parent &&
+        (!isFileStable(vm, result.cacheFile) || !areFilesStable(vm, dependencies)))
+    {
+        result.uptodate = VFuture;
+        result.data = VFuture;
+        return VCreateArrayFromData((vref*)&result, 3);
+    }
     result.uptodate = uptodate ? VTrue : VFalse;
     result.data = value;
     return VCreateArrayFromData((vref*)&result, 3);
@@ -533,10 +1002,9 @@ static vref nativeLines(VM *vm)
     vref content;
 
     if (value == VFuture || trimLastIfEmpty == VFuture ||
-        (vm->base.parent && VIsFile(value))) /* TODO */
+        (VIsFile(value) && !isFileStable(vm, value)))
     {
-        vm->idle = true;
-        return 0;
+        return VFuture;
     }
 
     content = VIsFile(value) ? readFile(value, 0) : value;
@@ -553,10 +1021,10 @@ static vref nativeMv(VM *vm)
     size_t oldLength;
     size_t newLength;
 
-    if (src == VFuture || dst == VFuture || vm->base.parent)
+    if (vm->base.parent)
     {
-        /* TODO */
-        vm->idle = true;
+        VMSkipModification(vm, src);
+        VMSkipModification(vm, dst);
         return 0;
     }
 
@@ -593,24 +1061,74 @@ static vref nativeParent(VM *vm)
     return VCreatePathUnchecked(VCreateString(s, (size_t)(slash - s + 1)));
 }
 
+/* Lets functions skip producing results their caller doesn't use. */
+static vref nativeReturnValueCount(VM *vm)
+{
+    return VBoxUint(VMCallerReturnValueCount(vm));
+}
+
 static vref nativePid(VM *vm unused)
 {
     return VBoxInteger(getpid());
 }
 
-static vref nativeReadFile(VM *vm)
+/* Pools are declared by all VMs, so that speculatively executing VMs can start jobs in them. */
+static vref nativePool(VM *vm)
 {
-    vref file = VMReadValue(vm);
-    vref valueIfNotExists = VMReadValue(vm);
+    vref name = VMReadValue(vm);
+    vref depth = VMReadValue(vm);
 
-    if (file == VFuture || valueIfNotExists == VFuture || vm->base.parent)
+    if (name == VFuture || depth == VFuture)
+    {
+        return 0;
+    }
+    if (!VIsString(name) || !VIsInteger(depth) || VUnboxInteger(depth) < 1)
     {
-        /* TODO */
-        vm->idle = true;
+        VMFailf(vm, "Pools must have a name and a depth of at least 1");
         return 0;
     }
+    JobSetPool(name, (uint)VUnboxInteger(depth));
+    return 0;
+}
+
+static vref nativeReadFile(VM *vm)
+{
+    vref arguments[2];
+    const char *path;
+    size_t length;
+    File file;
+    size_t size;
+    ReadTask *task;
+
+    arguments[0] = VMReadValue(vm);
+    arguments[1] = VMReadValue(vm);
+    if (arguments[0] == VFuture || arguments[1] == VFuture || !isFileStable(vm, arguments[0]))
+    {
+        return VFuture;
+    }
+    if (vm->job)
+    {
+        /* Started by the speculatively executing VM this VM has replaced. */
+        return VFuture;
+    }
 
-    return readFile(file, valueIfNotExists);
+    path = VGetPath(arguments[0], &length);
+    if (!FileTryOpen(&file, path, length))
+    {
+        return arguments[1];
+    }
+    size = FileSize(&file);
+    if (size < TASK_MIN_SIZE)
+    {
+        return readOpenFile(&file, size);
+    }
+    task = (ReadTask*)malloc(sizeof(*task));
+    task->fd = file.fd;
+    task->size = size;
+    task->string = VCreateUninitialisedString(size, &task->data);
+    vm->job = JobAddTask(readTask, task, readTaskFinish, vm, arguments, 2,
+                         VCreateArrayFromData(arguments, 1), VEmptyList);
+    return VFuture;
 }
 
 typedef struct
@@ -681,17 +1199,31 @@ static vref nativeRm(VM *vm)
     vref file = VMReadValue(vm);
     const char *path;
     size_t length;
+    int fd;
+    DeleteTask *task;
 
-    if (file == VFuture || vm->base.parent)
+    if (vm->base.parent)
     {
-        /* TODO */
-        vm->idle = true;
+        VMSkipModification(vm, file);
         return 0;
     }
 
+    /* Only the contents of directories are deleted on a task thread, as a file is deleted with a
+       single system call. */
     path = VGetPath(file, &length);
-    FileDelete(path, length);
-    return 0;
+    fd = FileDeleteBegin(path, length);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    task = (DeleteTask*)malloc(sizeof(*task) + length + 1);
+    task->fd = fd;
+    task->path = (char*)(task + 1);
+    memcpy(task->path, path, length);
+    task->path[length] = 0;
+    vm->job = JobAddTask(deleteTask, task, deleteTaskFinish, vm, &file, 1, VEmptyList,
+                         VCreateArrayFromData(&file, 1));
+    return VFuture;
 }
 
 static vref nativeSetUptodate(VM *vm)
@@ -705,13 +1237,12 @@ static vref nativeSetUptodate(VM *vm)
 
     if (vm->base.parent)
     {
-        /* TODO */
-        vm->idle = true;
+        VMSkipModification(vm, cacheFile);
         return 0;
     }
 
     path = VGetPath(cacheFile, &length);
-    CacheSetUptodate(path, length, accessedFiles, out, data);
+    CacheSetUptodate(path, length, accessedFiles, out, data, vm->stepTime);
     return 0;
 }
 
@@ -748,12 +1279,10 @@ static vref nativeSplit(VM *vm)
     vref removeEmpty = VMReadValue(vm);
     vref data;
 
-    if (value == VFuture || delimiter == VFuture ||
-        removeEmpty == VFuture || (vm->base.parent && VIsFile(value)))
+    if (value == VFuture || delimiter == VFuture || removeEmpty == VFuture ||
+        (VIsFile(value) && !isFileStable(vm, value)))
     {
-        /* TODO */
-        vm->idle = true;
-        return 0;
+        return VFuture;
     }
 
     data = VIsFile(value) ? readFile(value, 0) : value;
@@ -762,6 +1291,11 @@ static vref nativeSplit(VM *vm)
     return VSplit(data, delimiter, VIsTruthy(removeEmpty), false);
 }
 
+static vref nativeTraceAvailable(VM *vm unused)
+{
+    return TraceAvailable() ? VTrue : VFalse;
+}
+
 static vref nativeWriteFile(VM *vm)
 {
     vref file = VMReadValue(vm);
@@ -772,17 +1306,37 @@ static vref nativeWriteFile(VM *vm)
     byte buffer[1024];
     size_t offset = 0;
     size_t size;
+    WriteTask *task;
+    vref arguments[2];
 
-    if (file == VFuture || data == VFuture || vm->base.parent)
+    if (vm->base.parent)
     {
-        /* TODO */
-        vm->idle = true;
+        VMSkipModification(vm, file);
         return 0;
     }
 
     size = VStringLength(data);
     path = VGetPath(file, &pathLength);
     FileOpenAppend(&f, path, pathLength, true);
+    if (size >= TASK_MIN_SIZE)
+    {
+        task = (WriteTask*)malloc(sizeof(*task));
+        task->fd = f.fd;
+        task->size = size;
+        task->data = VGetStringData(data);
+        task->copy = null;
+        if (!task->data)
+        {
+            task->copy = (char*)malloc(size);
+            VWriteString(data, task->copy);
+            task->data = task->copy;
+        }
+        arguments[0] = file;
+        arguments[1] = data;
+        vm->job = JobAddTask(writeTask, task, writeTaskFinish, vm, arguments, 2, VEmptyList,
+                             VCreateArrayFromData(&file, 1));
+        return VFuture;
+    }
     while (size)
     {
         size_t chunkSize = min(size, sizeof(buffer));
@@ -812,7 +1366,9 @@ void NativeInit(void)
 {
     addFunctionInfo("cp",          nativeCp,          2, 0);
     addFunctionInfo("echo",        nativeEcho,        2, 0);
-    addFunctionInfo("exec",        nativeExec,        8, 3);
+    addFunctionInfo("exec",        nativeExec,        12, 3);
+    addFunctionInfo("execAll",     nativeExecAll,     11, 1);
+    addFunctionInfo("execPipe",    nativeExecPipe,    11, 1);
     addFunctionInfo("fail",        nativeFail,        1, 0);
     addFunctionInfo("file",        nativeFile,        3, 1);
     addFunctionInfo("filename",    nativeFilename,    1, 1);
@@ -824,12 +1380,15 @@ void NativeInit(void)
     addFunctionInfo("mv",          nativeMv,          2, 0);
     addFunctionInfo("parent",      nativeParent,      1, 1);
     addFunctionInfo("pid",         nativePid,         0, 1);
+    addFunctionInfo("pool",        nativePool,        2, 0);
     addFunctionInfo("readFile",    nativeReadFile,    2, 1);
     addFunctionInfo("replace",     nativeReplace,     3, 2);
+    addFunctionInfo("returnValueCount", nativeReturnValueCount, 0, 1);
     addFunctionInfo("rm",          nativeRm,          1, 0);
     addFunctionInfo("setUptodate", nativeSetUptodate, 4, 0);
     addFunctionInfo("size",        nativeSize,        1, 1);
     addFunctionInfo("split",       nativeSplit,       3, 1);
+    addFunctionInfo("traceAvailable", nativeTraceAvailable, 0, 1);
     addFunctionInfo("writeFile",   nativeWriteFile,   2, 0);
     assert(initFunctionIndex == NATIVE_FUNCTION_COUNT);
 }
@@ -1,4 +1,4 @@
-#define NATIVE_MAX_VALUES 11
+#define NATIVE_MAX_VALUES 15
 
 struct _Work;
 
@@ -3,7 +3,22 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#if HAVE_SPLICE
+#include <sys/uio.h>
+#endif
+#if HAVE_MEMFD
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#else
 #include <sys/select.h>
+#endif
+#if HAVE_PIDFD
+#include <sys/syscall.h>
+#endif
 #include <unistd.h>
 #include "common.h"
 #include "bytevector.h"
@@ -12,6 +27,19 @@
 #include "value.h"
 
 #define MIN_READ_BUFFER 1024
+#define MAX_READ_BUFFER (1024 * 1024)
+/* Bytes of output kept in memory before it is moved to a memfd, which is mapped as the string when
+   the pipe is disposed. */
+#define SPILL_THRESHOLD (16 * 1024 * 1024)
+/* Bytes moved by one call to splice. */
+#define SPLICE_SIZE (1024 * 1024)
+
+#if HAVE_EPOLL
+#define MAX_EVENTS 64
+/* epoll data for watched processes and inputs, which only need to wake up PipeProcess. Pipes use
+   their handle. */
+#define WATCH_EVENT -1
+#endif
 
 typedef enum
 {
@@ -26,9 +54,33 @@ typedef struct
     size_t bufferPos;
     int fd, fdSourceOrSink;
     PipeState state;
+    bool discard; /* Data isn't kept once written to fdSourceOrSink. */
+    bool grown; /* The capacity of the pipe has been increased. */
+    const byte *source; /* Data written instead of buffer, from PipeCreateReadFrom. */
+    size_t sourceSize;
+    int spillFD; /* memfd holding the data read before what is in buffer, or -1. */
+    size_t spillSize;
 } Pipe;
 
+#if HAVE_MEMFD
+typedef struct
+{
+    void *data;
+    size_t size;
+} SpillMapping;
+#endif
+
 static bytevector pipes;
+#if HAVE_MEMFD
+/* SpillMapping of each mapped memfd. The heap doesn't free strings, so they are only unmapped by
+   PipeDisposeAll. */
+static bytevector spillMappings;
+#endif
+#if HAVE_EPOLL
+static int epollFD = -1;
+#else
+static bytevector watchedInputs; /* int */
+#endif
 
 
 static Pipe *getPipe(int handle)
@@ -36,14 +88,62 @@ static Pipe *getPipe(int handle)
     return (Pipe*)BVGetPointer(&pipes, (size_t)handle);
 }
 
+static void closeFD(Pipe *pipe)
+{
+#if HAVE_EPOLL
+    /* A forked child that hasn't executed yet may keep the pipe open, so removing it from the
+       epoll set isn't implied by closing it. */
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, pipe->fd, null);
+#endif
+    close(pipe->fd);
+    pipe->fd = -1;
+}
+
+#if HAVE_MEMFD
+static void spill(Pipe *pipe);
+
+/* Returns the data of a pipe that has spilled, mapped from the memfd. */
+static vref mapSpill(Pipe *pipe)
+{
+    void *data;
+    SpillMapping *mapping;
+    spill(pipe);
+    /* Extended with a 0 byte to terminate the string. */
+    if (unlikely(ftruncate(pipe->spillFD, (off_t)pipe->spillSize + 1)))
+    {
+        FailErrno(false);
+    }
+    data = mmap(null, pipe->spillSize + 1, PROT_READ, MAP_SHARED, pipe->spillFD, 0);
+    if (unlikely(data == MAP_FAILED))
+    {
+        FailErrno(false);
+    }
+    mapping = (SpillMapping*)BVGetAppendPointer(&spillMappings, sizeof(SpillMapping));
+    mapping->data = data;
+    mapping->size = pipe->spillSize + 1;
+    return VCreateExternalString((const char*)data, pipe->spillSize);
+}
+#endif
+
 static void pipeDispose(Pipe *pipe, vref *value)
 {
     pipe->state = PIPE_UNUSED;
     if (pipe->fd >= 0)
     {
-        close(pipe->fd);
-        pipe->fd = -1;
+        closeFD(pipe);
     }
+#if HAVE_MEMFD
+    if (pipe->spillFD >= 0)
+    {
+        if (value)
+        {
+            *value = mapSpill(pipe);
+            value = null;
+        }
+        close(pipe->spillFD);
+        pipe->spillFD = -1;
+    }
+#endif
     if (BVIsInitialized(&pipe->buffer))
     {
         if (value)
@@ -63,27 +163,423 @@ void PipeInit(void)
 {
     /* TODO: Check this number. Use number of allowed concurrent jobs? */
     BVInit(&pipes, 16 * sizeof(Pipe));
+#if HAVE_MEMFD
+    BVInit(&spillMappings, 4 * sizeof(SpillMapping));
+#endif
+#if HAVE_EPOLL
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (unlikely(epollFD < 0))
+    {
+        FailErrno(false);
+    }
+#else
+    BVInit(&watchedInputs, 4 * sizeof(int));
+#endif
 }
 
 void PipeDisposeAll(void)
 {
     Pipe *pipe = (Pipe*)BVGetPointer(&pipes, 0);
     Pipe *stop = (Pipe*)((byte*)pipe + BVSize(&pipes));
+#if HAVE_MEMFD
+    const SpillMapping *mapping = (const SpillMapping*)BVGetPointer(&spillMappings, 0);
+    const SpillMapping *mappingStop = (const SpillMapping*)(BVGetPointer(&spillMappings, 0) +
+                                                            BVSize(&spillMappings));
+#endif
     while (pipe < stop)
     {
         pipeDispose(pipe++, null);
     }
     BVDispose(&pipes);
+#if HAVE_MEMFD
+    for (; mapping < mappingStop; mapping++)
+    {
+        munmap(mapping->data, mapping->size);
+    }
+    BVDispose(&spillMappings);
+#endif
+#if HAVE_EPOLL
+    close(epollFD);
+#else
+    BVDispose(&watchedInputs);
+#endif
+}
+
+static void writeAll(int fd, const byte *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t writeSize = write(fd, data, size);
+        if (unlikely(writeSize < 0))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            FailErrno(false);
+        }
+        data += writeSize;
+        size -= (size_t)writeSize;
+    }
+}
+
+#if HAVE_MEMFD
+/* Moves the data in the buffer to the memfd, which is created first if needed. */
+static void spill(Pipe *pipe)
+{
+    if (pipe->spillFD < 0)
+    {
+        pipe->spillFD = memfd_create("don-output", MFD_CLOEXEC);
+        if (unlikely(pipe->spillFD < 0))
+        {
+            FailErrno(false);
+        }
+        pipe->spillSize = 0;
+    }
+    if (BVIsInitialized(&pipe->buffer))
+    {
+        writeAll(pipe->spillFD, BVGetPointer(&pipe->buffer, 0), BVSize(&pipe->buffer));
+        pipe->spillSize += BVSize(&pipe->buffer);
+        if (BVSize(&pipe->buffer) > MAX_READ_BUFFER)
+        {
+            BVDispose(&pipe->buffer);
+            BVInit(&pipe->buffer, MAX_READ_BUFFER);
+        }
+        BVSetSize(&pipe->buffer, 0);
+    }
+}
+
+/* Writes the data that has been moved to the memfd to the sink. */
+static void writeSpillToSink(const Pipe *pipe)
+{
+    off_t offset = 0;
+    ssize_t size;
+    while ((size_t)offset < pipe->spillSize)
+    {
+        size = sendfile(pipe->fdSourceOrSink, pipe->spillFD, &offset,
+                        pipe->spillSize - (size_t)offset);
+        if (unlikely(size < 0))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            FailErrno(false);
+        }
+        if (unlikely(!size))
+        {
+            Fail("don: Short write of buffered output\n");
+        }
+    }
+}
+#endif
+
+static void writeSink(const Pipe *pipe, size_t offset)
+{
+    writeAll(pipe->fdSourceOrSink, BVGetPointer(&pipe->buffer, offset),
+             BVSize(&pipe->buffer) - offset);
+}
+
+/* Writes data that stays unchanged until the pipe is closed, letting the pipe reference its pages
+   instead of copying them if possible. */
+static ssize_t writeUnchanging(int fd, const byte *data, size_t size)
+{
+#if HAVE_SPLICE
+    static bool unsupported;
+    struct iovec iov;
+    ssize_t writeSize;
+
+    if (!unsupported)
+    {
+        iov.iov_base = (void*)data;
+        iov.iov_len = size;
+        writeSize = vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK);
+        if (writeSize >= 0 || (errno != EINVAL && errno != ENOSYS))
+        {
+            return writeSize;
+        }
+        unsupported = true;
+    }
+#endif
+    return write(fd, data, size);
+}
+
+static void processWrite(Pipe *pipe)
+{
+    const byte *data;
+    size_t left;
+    ssize_t writeSize;
+
+    assert(pipe->fdSourceOrSink < 0); /* TODO */
+    if (pipe->source)
+    {
+        data = pipe->source + pipe->bufferPos;
+        left = pipe->sourceSize - pipe->bufferPos;
+    }
+    else
+    {
+        data = BVGetPointer(&pipe->buffer, pipe->bufferPos);
+        left = BVSize(&pipe->buffer) - pipe->bufferPos;
+    }
+    while (left)
+    {
+        writeSize = pipe->source ? writeUnchanging(pipe->fd, data, left) :
+            write(pipe->fd, data, left);
+        if (writeSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                return;
+            }
+            /* The process won't read the rest. */
+            break;
+        }
+        pipe->bufferPos += (size_t)writeSize;
+        data += writeSize;
+        left -= (size_t)writeSize;
+    }
+    closeFD(pipe);
+}
+
+/*
+  Moves data from the pipe to its sink without copying it to user space. Returns false if the pipe
+  has to be read instead, because the sink doesn't support splice or is full.
+*/
+static bool spliceRead(Pipe *pipe)
+{
+#if HAVE_SPLICE
+    static bool unsupported;
+    ssize_t size;
+    int available;
+
+    if (unsupported)
+    {
+        return false;
+    }
+    for (;;)
+    {
+        size = splice(pipe->fd, null, pipe->fdSourceOrSink, null, SPLICE_SIZE,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (size > 0)
+        {
+            continue;
+        }
+        if (!size)
+        {
+            closeFD(pipe);
+            return true;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN)
+        {
+            /* Reading blocks on a full sink, rather than waking up again immediately. */
+            return ioctl(pipe->fd, FIONREAD, &available) || !available;
+        }
+        if (errno == EINVAL)
+        {
+            unsupported = true;
+            return false;
+        }
+        FailErrno(false);
+    }
+#else
+    return false;
+#endif
+}
+
+/* Returns how much to read from the pipe, based on how much data it holds. */
+static size_t readHint(Pipe *pipe)
+{
+    int available;
+
+    if (ioctl(pipe->fd, FIONREAD, &available) || available <= MIN_READ_BUFFER)
+    {
+        return MIN_READ_BUFFER;
+    }
+#ifdef F_SETPIPE_SZ
+    /* A process filling the pipe gets a larger one, so that both it and don wake up less often. It
+       keeps the default size if the limit on pipe memory has been reached. */
+    if (!pipe->grown && available >= fcntl(pipe->fd, F_GETPIPE_SZ))
+    {
+        pipe->grown = true;
+        fcntl(pipe->fd, F_SETPIPE_SZ, MAX_READ_BUFFER);
+    }
+#endif
+    return min((size_t)available, MAX_READ_BUFFER);
 }
 
-void PipeProcess(void)
+static void processRead(Pipe *pipe)
+{
+    size_t oldSize;
+    size_t hint;
+    bool first = true;
+
+    if (pipe->discard && pipe->fdSourceOrSink >= 0 && spliceRead(pipe))
+    {
+        return;
+    }
+
+    if (!BVIsInitialized(&pipe->buffer))
+    {
+        byte buffer[MIN_READ_BUFFER];
+        ssize_t readSize;
+        oldSize = 0;
+        first = false;
+readAgain1:
+        readSize = read(pipe->fd, buffer, sizeof(buffer));
+        if (readSize > 0)
+        {
+            BVInit(&pipe->buffer, MIN_READ_BUFFER + (size_t)readSize);
+            BVAddData(&pipe->buffer, buffer, (size_t)readSize);
+            if (readSize != sizeof(buffer))
+            {
+                goto readComplete;
+            }
+        }
+        else if (unlikely(readSize < 0))
+        {
+            if (errno == EINTR)
+            {
+                goto readAgain1;
+            }
+            FailErrno(false);
+        }
+        else
+        {
+            closeFD(pipe);
+            return;
+        }
+    }
+    else
+    {
+        oldSize = BVSize(&pipe->buffer);
+    }
+
+    for (;;)
+    {
+        size_t prevSize = BVSize(&pipe->buffer);
+        byte *pbuffer;
+        ssize_t readSize;
+        size_t requestedSize;
+        hint = readHint(pipe);
+        pbuffer = BVGetAppendPointer(&pipe->buffer, hint);
+readAgain2:
+        requestedSize = hint + BVGetReservedAppendSize(&pipe->buffer);
+        readSize = read(pipe->fd, pbuffer, requestedSize);
+        if (readSize > 0)
+        {
+            first = false;
+            BVSetSize(&pipe->buffer, prevSize + (size_t)readSize);
+            if (requestedSize != (size_t)readSize)
+            {
+                break;
+            }
+        }
+        else if (readSize < 0)
+        {
+            if (likely(errno == EWOULDBLOCK))
+            {
+                BVSetSize(&pipe->buffer, prevSize);
+                break;
+            }
+            if (errno == EINTR)
+            {
+                goto readAgain2;
+            }
+            FailErrno(false);
+        }
+        else
+        {
+            BVSetSize(&pipe->buffer, prevSize);
+            if (first)
+            {
+                closeFD(pipe);
+            }
+            break;
+        }
+    }
+
+readComplete:
+    if (pipe->fdSourceOrSink >= 0)
+    {
+        writeSink(pipe, oldSize);
+        if (pipe->discard)
+        {
+            BVSetSize(&pipe->buffer, 0);
+        }
+    }
+#if HAVE_MEMFD
+    if (pipe->spillFD >= 0 || BVSize(&pipe->buffer) >= SPILL_THRESHOLD)
+    {
+        spill(pipe);
+    }
+#endif
+}
+
+#if HAVE_EPOLL
+
+void PipeProcess(int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int count;
+    int i;
+
+    do
+    {
+        count = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+    }
+    while (count < 0 && errno == EINTR);
+    if (unlikely(count < 0))
+    {
+        FailErrno(false);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        Pipe *pipe;
+        if (events[i].data.fd == WATCH_EVENT)
+        {
+            continue;
+        }
+        pipe = getPipe(events[i].data.fd);
+        if (pipe->fd < 0)
+        {
+            continue;
+        }
+        if (pipe->state == PIPE_WRITE)
+        {
+            processWrite(pipe);
+        }
+        else
+        {
+            processRead(pipe);
+        }
+    }
+}
+
+#else
+
+void PipeProcess(int timeout)
 {
     fd_set readSet, writeSet;
+    struct timeval tv;
     int status;
     Pipe *pipe = (Pipe*)BVGetPointer(&pipes, 0);
     Pipe *stop = (Pipe*)((byte*)pipe + BVSize(&pipes));
+    size_t i;
     FD_ZERO(&readSet);
     FD_ZERO(&writeSet);
+    for (i = 0; i < BVSize(&watchedInputs); i += sizeof(int))
+    {
+        FD_SET(BVGetInt(&watchedInputs, i), &readSet);
+    }
     while (pipe < stop)
     {
         if (pipe->fd >= 0)
@@ -94,7 +590,9 @@ void PipeProcess(void)
     }
 
 wait:
-    status = select(FD_SETSIZE, &readSet, &writeSet, null, null);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = timeout % 1000 * 1000;
+    status = select(FD_SETSIZE, &readSet, &writeSet, null, timeout < 0 ? null : &tv);
     if (unlikely(status < 0))
     {
         if (errno == EINTR)
@@ -110,148 +608,68 @@ wait:
         {
             continue;
         }
-
         if (pipe->state == PIPE_WRITE)
         {
-            const byte *data;
-            size_t left;
-
-            assert(pipe->fdSourceOrSink < 0); /* TODO */
-            if (!FD_ISSET(pipe->fd, &writeSet))
+            if (FD_ISSET(pipe->fd, &writeSet))
             {
-                continue;
-            }
-
-            data = BVGetPointer(&pipe->buffer, pipe->bufferPos);
-            left = BVSize(&pipe->buffer) - pipe->bufferPos;
-            if (left)
-            {
-                ssize_t writeSize;
-        writeAgain:
-                writeSize = write(pipe->fd, data, left);
-                if (writeSize < 0)
-                {
-                    if (errno == EINTR)
-                    {
-                        goto writeAgain;
-                    }
-                }
-                pipe->bufferPos += (size_t)writeSize;
-                left -= (size_t)writeSize;
-            }
-            if (!left)
-            {
-                close(pipe->fd);
-                pipe->fd = -1;
+                processWrite(pipe);
             }
         }
         else if (FD_ISSET(pipe->fd, &readSet))
         {
-            size_t oldSize;
-            bool first = true;
+            processRead(pipe);
+        }
+    }
+}
 
-            if (!BVIsInitialized(&pipe->buffer))
-            {
-                byte buffer[MIN_READ_BUFFER];
-                ssize_t readSize;
-                oldSize = 0;
-                first = false;
-        readAgain1:
-                readSize = read(pipe->fd, buffer, sizeof(buffer));
-                if (readSize > 0)
-                {
-                    BVInit(&pipe->buffer, MIN_READ_BUFFER + (size_t)readSize);
-                    BVAddData(&pipe->buffer, buffer, (size_t)readSize);
-                    if (readSize != sizeof(buffer))
-                    {
-                        goto readComplete;
-                    }
-                }
-                else if (unlikely(readSize < 0))
-                {
-                    if (errno == EINTR)
-                    {
-                        goto readAgain1;
-                    }
-                    FailErrno(false);
-                }
-                else
-                {
-                    close(pipe->fd);
-                    pipe->fd = -1;
-                    continue;
-                }
-            }
-            else
-            {
-                oldSize = BVSize(&pipe->buffer);
-            }
+#endif
 
-            for (;;)
-            {
-                size_t prevSize = BVSize(&pipe->buffer);
-                byte *pbuffer = BVGetAppendPointer(&pipe->buffer, MIN_READ_BUFFER);
-                ssize_t readSize;
-                size_t requestedSize;
-        readAgain2:
-                requestedSize = MIN_READ_BUFFER + BVGetReservedAppendSize(&pipe->buffer);
-                readSize = read(pipe->fd, pbuffer, requestedSize);
-                if (readSize > 0)
-                {
-                    first = false;
-                    BVSetSize(&pipe->buffer, prevSize + (size_t)readSize);
-                    if (requestedSize != (size_t)readSize)
-                    {
-                        break;
-                    }
-                }
-                else if (readSize < 0)
-                {
-                    if (likely(errno == EWOULDBLOCK))
-                    {
-                        BVSetSize(&pipe->buffer, prevSize);
-                        break;
-                    }
-                    if (errno == EINTR)
-                    {
-                        goto readAgain2;
-                    }
-                    FailErrno(false);
-                }
-                else
-                {
-                    BVSetSize(&pipe->buffer, prevSize);
-                    if (first)
-                    {
-                        close(pipe->fd);
-                        pipe->fd = -1;
-                    }
-                    break;
-                }
-            }
+int PipeWatchProcess(int pid)
+{
+#if HAVE_EPOLL && HAVE_PIDFD && defined(SYS_pidfd_open)
+    struct epoll_event event;
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0)
+    {
+        /* Not supported by the kernel. */
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    /* The pidfd stays readable until the process is reaped, which may be a while after it has
+       exited if its output is still open. */
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = WATCH_EVENT;
+    if (unlikely(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event)))
+    {
+        FailErrno(false);
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
 
-    readComplete:
-            if (pipe->fdSourceOrSink >= 0)
-            {
-                size_t readSize = BVSize(&pipe->buffer) - oldSize;
-                const byte *pbuffer = BVGetPointer(&pipe->buffer, oldSize);
-                while (readSize)
-                {
-                    ssize_t writeSize = write(pipe->fdSourceOrSink, pbuffer, readSize);
-                    if (unlikely(writeSize < 0))
-                    {
-                        if (errno == EINTR)
-                        {
-                            continue;
-                        }
-                        FailErrno(false);
-                    }
-                    pbuffer += writeSize;
-                    readSize -= (size_t)writeSize;
-                }
-            }
-        }
+void PipeWatchInput(int fd)
+{
+#if HAVE_EPOLL
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = WATCH_EVENT;
+    if (unlikely(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event)))
+    {
+        FailErrno(false);
     }
+#else
+    BVAddInt(&watchedInputs, fd);
+#endif
+}
+
+void PipeUnwatchProcess(int watch)
+{
+#if HAVE_EPOLL
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, watch, null);
+#endif
+    close(watch);
 }
 
 
@@ -290,7 +708,21 @@ static Pipe *pipeCreate(int *pfd, bool read)
     pipe->fd = fd[read ? 1 : 0];
     fcntl(pipe->fd, F_SETFL, O_NONBLOCK);
     pipe->fdSourceOrSink = -1;
+    pipe->discard = false;
+    pipe->grown = false;
+    pipe->spillFD = -1;
     *pfd = fd[read ? 0 : 1];
+#if HAVE_EPOLL
+    {
+        struct epoll_event event;
+        event.events = read ? EPOLLOUT : EPOLLIN;
+        event.data.fd = (int)((byte*)pipe - BVGetPointer(&pipes, 0));
+        if (unlikely(epoll_ctl(epollFD, EPOLL_CTL_ADD, pipe->fd, &event)))
+        {
+            FailErrno(false);
+        }
+    }
+#endif
     return pipe;
 }
 
@@ -310,6 +742,15 @@ int PipeCreateRead(int *fdRead, bytevector **buffer, size_t bufferSize)
     return (int)((byte*)pipe - BVGetPointer(&pipes, 0));
 }
 
+int PipeCreateReadFrom(int *fdRead, const char *data, size_t size)
+{
+    Pipe *pipe = pipeCreate(fdRead, true);
+    pipe->source = (const byte*)data;
+    pipe->sourceSize = size;
+    pipe->state = PIPE_WRITE;
+    return (int)((byte*)pipe - BVGetPointer(&pipes, 0));
+}
+
 bool PipeIsOpen(int handle)
 {
     Pipe *pipe = getPipe(handle);
@@ -325,6 +766,24 @@ void PipeConnect(int handle, int fd)
 {
     Pipe *pipe = getPipe(handle);
     assert(pipe->fdSourceOrSink < 0);
-    assert(!BVIsInitialized(&pipe->buffer)); /* TODO: Copy buffered data */
     pipe->fdSourceOrSink = fd;
+#if HAVE_MEMFD
+    if (pipe->spillFD >= 0)
+    {
+        writeSpillToSink(pipe);
+    }
+#endif
+    if (BVIsInitialized(&pipe->buffer))
+    {
+        writeSink(pipe, 0);
+        if (pipe->discard)
+        {
+            BVSetSize(&pipe->buffer, 0);
+        }
+    }
+}
+
+void PipeDiscard(int handle)
+{
+    getPipe(handle)->discard = true;
 }
@@ -1,6 +1,15 @@
 void PipeInit(void);
 void PipeDisposeAll(void);
-void PipeProcess(void);
+/* Reads and writes pending data of all pipes. Waits at most timeout milliseconds for a pipe to
+   become ready, or indefinitely if timeout is negative. */
+void PipeProcess(int timeout);
+
+/* Makes PipeProcess return when the process exits. Returns a handle for PipeUnwatchProcess, or -1
+   if not supported, in which case the caller has to poll. */
+int PipeWatchProcess(int pid);
+void PipeUnwatchProcess(int watch);
+/* Makes PipeProcess return when fd is readable. */
+void PipeWatchInput(int fd);
 
 
 /* The returned handle (>= 0) may be used when calling other Pipe* functions.
@@ -15,6 +24,13 @@ nonnull int PipeCreateWrite(int *fdWrite);
    caller.
 */
 nonnull int PipeCreateRead(int *fdRead, bytevector **buffer, size_t bufferSize);
+/* Like PipeCreateRead, but data is written from where it is. It must stay unchanged until the
+   pipe has been disposed, so that the pipe can reference it instead of copying it. */
+nonnull int PipeCreateReadFrom(int *fdRead, const char *data, size_t size);
 bool PipeIsOpen(int pipe);
 void PipeDispose(int pipe, vref *value);
+/* Writes all data read from the pipe to fd, including data that has already been read. */
 void PipeConnect(int pipe, int fd);
+/* Makes the pipe drop data once it has been written to the fd it is connected to, instead of
+   keeping it for PipeDispose. Data is moved to the fd without copying it when possible. */
+void PipeDiscard(int pipe);
@@ -0,0 +1,710 @@
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#if USE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "bytevector.h"
+#include "debug.h"
+#include "fail.h"
+#include "jobserver.h"
+#include "pipe.h"
+#include "spawn.h"
+#include "util.h"
+
+/*
+  A request is followed by the executable, arguments and environment variables as zero terminated
+  strings. The file descriptors for stdout, stderr and (if redirected) stdin are passed along with
+  it.
+*/
+typedef struct
+{
+    size_t size; /* Size of the strings */
+    uint argumentCount;
+    uint environmentCount;
+    bool newProcessGroup;
+    bool redirectStdin;
+    int jobserverFDs[2]; /* Inherited by the process, or -1. */
+} Request;
+
+typedef enum
+{
+    REPLY_STARTED,
+    REPLY_EXITED
+} ReplyType;
+
+typedef struct
+{
+    ReplyType type;
+    int pid;
+    int error; /* errno if the process couldn't be started */
+    int status;
+    struct rusage usage;
+} Reply;
+
+static int helperSocket = -1;
+static bytevector request;
+static bytevector exited; /* Reply of processes the helper has reaped, but SpawnReap hasn't. */
+static int childSignalPipe[2];
+
+typedef struct
+{
+    int pid;
+    ulong startTime; /* microseconds */
+} StartedProcess;
+
+static bytevector started; /* StartedProcess, when DEBUG_SPAWN is set */
+static bytevector latencies; /* ulong microseconds from start to exit, when DEBUG_SPAWN is set */
+static ulong firstStart;
+static ulong lastExit;
+
+
+/* The file descriptors in jobserverFDs that aren't -1 are inherited by the process, despite being
+   close-on-exec. */
+static int startProcess(const char *executable, char *const argv[], const char *const envp[],
+                        int fdIn, int fdOut, int fdErr, const int *jobserverFDs,
+                        bool newProcessGroup, bool forked)
+{
+    pid_t pid;
+    int status;
+    uint i;
+#if USE_POSIX_SPAWN
+    posix_spawn_file_actions_t psfa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&psfa);
+    posix_spawnattr_init(&attr);
+    if (fdIn != STDIN_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&psfa, fdIn, STDIN_FILENO);
+    }
+    posix_spawn_file_actions_adddup2(&psfa, fdOut, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&psfa, fdErr, STDERR_FILENO);
+    for (i = 0; i < 2; i++)
+    {
+        /* Duplicating a file descriptor to itself clears close-on-exec. */
+        if (jobserverFDs[i] >= 0)
+        {
+            posix_spawn_file_actions_adddup2(&psfa, jobserverFDs[i], jobserverFDs[i]);
+        }
+    }
+    if (newProcessGroup)
+    {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+    status = posix_spawn(&pid, executable, &psfa, &attr, argv, (char*const*)envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&psfa);
+    if (unlikely(status))
+    {
+        errno = status;
+        if (forked)
+        {
+            return -1;
+        }
+        FailErrno(false);
+    }
+#else
+    pid = VFORK();
+    if (!pid)
+    {
+        if (newProcessGroup)
+        {
+            status = setpgid(0, 0);
+            if (unlikely(status == -1))
+            {
+                FailErrno(true);
+            }
+        }
+        if (fdIn != STDIN_FILENO)
+        {
+            status = dup2(fdIn, STDIN_FILENO);
+            if (unlikely(status == -1))
+            {
+                FailErrno(true);
+            }
+        }
+        status = dup2(fdOut, STDOUT_FILENO);
+        if (unlikely(status == -1))
+        {
+            FailErrno(true);
+        }
+        status = dup2(fdErr, STDERR_FILENO);
+        if (unlikely(status == -1))
+        {
+            FailErrno(true);
+        }
+        for (i = 0; i < 2; i++)
+        {
+            if (jobserverFDs[i] >= 0)
+            {
+                fcntl(jobserverFDs[i], F_SETFD, 0);
+            }
+        }
+
+        execve(executable, argv, (char*const*)envp);
+        _exit(EXIT_FAILURE);
+    }
+    if (unlikely(pid < 0) && !forked)
+    {
+        FailErrno(false);
+    }
+#endif
+    return pid;
+}
+
+
+static void writeAll(int fd, const byte *data, size_t size, bool forked)
+{
+    while (size)
+    {
+        ssize_t writeSize = write(fd, data, size);
+        if (unlikely(writeSize < 0))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            FailErrno(forked);
+        }
+        data += writeSize;
+        size -= (size_t)writeSize;
+    }
+}
+
+/* Returns false at end of file, if nothing has been read. */
+static bool readAll(int fd, byte *data, size_t size, bool forked)
+{
+    bool first = true;
+    while (size)
+    {
+        ssize_t readSize = read(fd, data, size);
+        if (unlikely(readSize <= 0))
+        {
+            if (!readSize && first)
+            {
+                return false;
+            }
+            if (readSize && errno == EINTR)
+            {
+                continue;
+            }
+            if (!readSize)
+            {
+                Fail("don: Unexpected end of spawn helper messages\n");
+            }
+            FailErrno(forked);
+        }
+        first = false;
+        data += readSize;
+        size -= (size_t)readSize;
+    }
+    return true;
+}
+
+
+static void helperSignal(int sig)
+{
+    int oldErrno = errno;
+    ssize_t unused writeSize;
+    if (sig == SIGCHLD)
+    {
+        writeSize = write(childSignalPipe[1], "", 1);
+    }
+    errno = oldErrno;
+}
+
+static void helperReportExits(int fd)
+{
+    Reply reply;
+    char buffer[16];
+
+    while (read(childSignalPipe[0], buffer, sizeof(buffer)) > 0);
+    memset(&reply, 0, sizeof(reply));
+    reply.type = REPLY_EXITED;
+    for (;;)
+    {
+        reply.pid = wait4(-1, &reply.status, WNOHANG, &reply.usage);
+        if (reply.pid <= 0)
+        {
+            if (reply.pid < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        writeAll(fd, (const byte*)&reply, sizeof(reply), true);
+    }
+}
+
+/* Returns false when don has exited. */
+static bool helperStart(int fd, bytevector *buffer)
+{
+    Request header;
+    Reply reply;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char data[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    int fds[3];
+    uint fdCount;
+    char **argv;
+    char **envp;
+    char *p;
+    uint i;
+    ssize_t readSize;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    /* Only the copies made by dup2 should be inherited, or a process left running in the
+       background would keep the pipes open. */
+    do
+    {
+        readSize = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while (readSize < 0 && errno == EINTR);
+    if (readSize <= 0)
+    {
+        return false;
+    }
+    if ((size_t)readSize < sizeof(header))
+    {
+        readAll(fd, (byte*)&header + readSize, sizeof(header) - (size_t)readSize, true);
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    assert(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS);
+    fdCount = (uint)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    assert(fdCount == (header.redirectStdin ? 3u : 2u));
+    memcpy(fds, CMSG_DATA(cmsg), fdCount * sizeof(int));
+
+    BVSetSize(buffer, 0);
+    p = (char*)BVGetAppendPointer(buffer, header.size);
+    readAll(fd, (byte*)p, header.size, true);
+    argv = (char**)malloc((header.argumentCount + header.environmentCount + 2) * sizeof(char*));
+    if (!argv)
+    {
+        FailOOM();
+    }
+    envp = argv + header.argumentCount + 1;
+    p += strlen(p) + 1;
+    for (i = 0; i < header.argumentCount; i++)
+    {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[i] = null;
+    for (i = 0; i < header.environmentCount; i++)
+    {
+        envp[i] = p;
+        p += strlen(p) + 1;
+    }
+    envp[i] = null;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.type = REPLY_STARTED;
+    reply.pid = startProcess((const char*)BVGetPointer(buffer, 0), argv, (const char*const*)envp,
+                             header.redirectStdin ? fds[2] : STDIN_FILENO, fds[0], fds[1],
+                             header.jobserverFDs, header.newProcessGroup, true);
+    reply.error = errno;
+    free(argv);
+    for (i = 0; i < fdCount; i++)
+    {
+        close(fds[i]);
+    }
+    writeAll(fd, (const byte*)&reply, sizeof(reply), true);
+    return true;
+}
+
+static noreturn void helperMain(int fd)
+{
+    struct pollfd fds[2];
+    bytevector buffer;
+
+    BVInit(&buffer, 4096);
+    for (;;)
+    {
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = childSignalPipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            FailErrno(true);
+        }
+        if (fds[1].revents)
+        {
+            helperReportExits(fd);
+        }
+        if (fds[0].revents && !helperStart(fd, &buffer))
+        {
+            _exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+static void startHelper(void)
+{
+    int sockets[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets))
+    {
+        /* Start processes directly instead. */
+        return;
+    }
+    pid = fork();
+    if (pid < 0)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+        return;
+    }
+    if (!pid)
+    {
+        struct sigaction action;
+
+        close(sockets[0]);
+        if (pipe(childSignalPipe))
+        {
+            FailErrno(true);
+        }
+        fcntl(childSignalPipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(childSignalPipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(childSignalPipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(childSignalPipe[1], F_SETFL, O_NONBLOCK);
+        /* The helper exits when don does. Handled signals are reset to their default action when
+           a process is started, unlike ignored ones. */
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = helperSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction(SIGCHLD, &action, null);
+        sigaction(SIGHUP, &action, null);
+        sigaction(SIGINT, &action, null);
+        sigaction(SIGTERM, &action, null);
+        sigaction(SIGQUIT, &action, null);
+        helperMain(sockets[1]);
+    }
+    close(sockets[1]);
+    helperSocket = sockets[0];
+}
+
+static void storeExited(const Reply *reply)
+{
+    assert(reply->type == REPLY_EXITED);
+    BVAddData(&exited, (const byte*)reply, sizeof(*reply));
+}
+
+/* Returns false if wait is false and no message is available. */
+static bool readReply(Reply *reply, bool wait)
+{
+    ssize_t readSize;
+    do
+    {
+        readSize = recv(helperSocket, reply, sizeof(*reply), wait ? 0 : MSG_DONTWAIT);
+    }
+    while (readSize < 0 && errno == EINTR);
+    if (readSize < 0 && errno == EWOULDBLOCK)
+    {
+        return false;
+    }
+    if (unlikely(readSize <= 0))
+    {
+        if (!readSize)
+        {
+            Fail("don: Spawn helper exited\n");
+        }
+        FailErrno(false);
+    }
+    if ((size_t)readSize < sizeof(*reply))
+    {
+        readAll(helperSocket, (byte*)reply + readSize, sizeof(*reply) - (size_t)readSize, false);
+    }
+    return true;
+}
+
+static int helperStartProcess(const char *executable, char *const argv[],
+                              const char *const envp[], int fdIn, int fdOut, int fdErr,
+                              const int *jobserverFDs, bool newProcessGroup)
+{
+    Request *header;
+    Reply reply;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char data[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    int fds[3];
+    uint fdCount;
+    const char *const*p;
+    ssize_t writeSize;
+
+    BVSetSize(&request, sizeof(Request));
+    BVAddData(&request, (const byte*)executable, strlen(executable) + 1);
+    for (p = (const char*const*)argv; *p; p++)
+    {
+        BVAddData(&request, (const byte*)*p, strlen(*p) + 1);
+    }
+    for (p = envp; *p; p++)
+    {
+        BVAddData(&request, (const byte*)*p, strlen(*p) + 1);
+    }
+    header = (Request*)BVGetPointer(&request, 0);
+    memset(header, 0, sizeof(*header));
+    header->size = BVSize(&request) - sizeof(Request);
+    for (p = (const char*const*)argv; *p; p++)
+    {
+        header->argumentCount++;
+    }
+    for (p = envp; *p; p++)
+    {
+        header->environmentCount++;
+    }
+    header->newProcessGroup = newProcessGroup;
+    header->redirectStdin = fdIn != STDIN_FILENO;
+    /* The helper has the jobserver file descriptors already, as it was forked after they were
+       created. */
+    header->jobserverFDs[0] = jobserverFDs[0];
+    header->jobserverFDs[1] = jobserverFDs[1];
+
+    fds[0] = fdOut;
+    fds[1] = fdErr;
+    fds[2] = fdIn;
+    fdCount = header->redirectStdin ? 3 : 2;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void*)header;
+    iov.iov_len = BVSize(&request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+    do
+    {
+        writeSize = sendmsg(helperSocket, &msg, 0);
+    }
+    while (writeSize < 0 && errno == EINTR);
+    if (unlikely(writeSize < 0))
+    {
+        FailErrno(false);
+    }
+    writeAll(helperSocket, BVGetPointer(&request, (size_t)writeSize),
+             BVSize(&request) - (size_t)writeSize, false);
+
+    for (;;)
+    {
+        readReply(&reply, true);
+        if (reply.type == REPLY_STARTED)
+        {
+            break;
+        }
+        storeExited(&reply);
+    }
+    if (unlikely(reply.pid < 0))
+    {
+        errno = reply.error;
+        FailErrno(false);
+    }
+    return reply.pid;
+}
+
+static void recordStart(int pid, ulong time)
+{
+    StartedProcess *p = (StartedProcess*)BVGetAppendPointer(&started, sizeof(StartedProcess));
+    p->pid = pid;
+    p->startTime = time;
+    if (!firstStart)
+    {
+        firstStart = time;
+    }
+}
+
+static void recordExit(int pid)
+{
+    ulong time = UtilTimeMicros();
+    const StartedProcess *p = (const StartedProcess*)BVGetPointer(&started, 0);
+    const StartedProcess *stop = (const StartedProcess*)(BVGetPointer(&started, 0) +
+                                                         BVSize(&started));
+    for (; p < stop; p++)
+    {
+        if (p->pid == pid)
+        {
+            ulong latency = time - p->startTime;
+            BVAddData(&latencies, (const byte*)&latency, sizeof(latency));
+            BVRemoveRange(&started, (size_t)((const byte*)p - BVGetPointer(&started, 0)),
+                          sizeof(*p));
+            break;
+        }
+    }
+    lastExit = time;
+}
+
+static int compareLatency(const void *l1, const void *l2)
+{
+    ulong a = *(const ulong*)l1;
+    ulong b = *(const ulong*)l2;
+    return a < b ? -1 : a == b ? 0 : 1;
+}
+
+
+void SpawnInit(void)
+{
+    BVInit(&request, 4096);
+    BVInit(&exited, 16 * sizeof(Reply));
+    if (DEBUG_SPAWN)
+    {
+        BVInit(&started, 16 * sizeof(StartedProcess));
+        BVInit(&latencies, 1024 * sizeof(ulong));
+    }
+    if (USE_SPAWN_HELPER)
+    {
+        startHelper();
+        if (helperSocket >= 0)
+        {
+            PipeWatchInput(helperSocket);
+        }
+    }
+}
+
+void SpawnDispose(void)
+{
+    if (DEBUG_SPAWN)
+    {
+        BVDispose(&started);
+        BVDispose(&latencies);
+    }
+    if (helperSocket >= 0)
+    {
+        close(helperSocket);
+    }
+    BVDispose(&request);
+    BVDispose(&exited);
+}
+
+int SpawnProcess(const char *executable, char *const argv[], const char *const envp[],
+                 int fdIn, int fdOut, int fdErr, bool jobserverClient)
+{
+    /* The process is started in a process group of its own, so that it can be stopped along with
+       its children. A process in a background process group is stopped if it reads from the
+       terminal, so processes reading from the terminal stay in the process group of don. */
+    bool newProcessGroup = fdIn != STDIN_FILENO || !isatty(STDIN_FILENO);
+    ulong time = DEBUG_SPAWN ? UtilTimeMicros() : 0;
+    int jobserverFDs[2] = {-1, -1};
+    int pid;
+    if (jobserverClient)
+    {
+        JobserverGetClientFDs(&jobserverFDs[0], &jobserverFDs[1]);
+    }
+    if (helperSocket < 0)
+    {
+        pid = startProcess(executable, argv, envp, fdIn, fdOut, fdErr, jobserverFDs,
+                           newProcessGroup, false);
+    }
+    else
+    {
+        pid = helperStartProcess(executable, argv, envp, fdIn, fdOut, fdErr, jobserverFDs,
+                                 newProcessGroup);
+    }
+    if (DEBUG_SPAWN)
+    {
+        recordStart(pid, time);
+    }
+    return pid;
+}
+
+int SpawnReap(int pid, int *status, struct rusage *usage)
+{
+    Reply reply;
+    const Reply *r;
+    const Reply *stop;
+    int result;
+
+    if (helperSocket < 0)
+    {
+        do
+        {
+            result = wait4(pid, status, WNOHANG, usage);
+        }
+        while (result < 0 && errno == EINTR);
+        if (unlikely(result < 0))
+        {
+            FailErrno(false);
+        }
+        if (DEBUG_SPAWN && result)
+        {
+            recordExit(pid);
+        }
+        return result;
+    }
+
+    while (readReply(&reply, false))
+    {
+        storeExited(&reply);
+    }
+    r = (const Reply*)BVGetPointer(&exited, 0);
+    stop = (const Reply*)(BVGetPointer(&exited, 0) + BVSize(&exited));
+    for (; r < stop; r++)
+    {
+        if (r->pid == pid)
+        {
+            *status = r->status;
+            *usage = r->usage;
+            BVRemoveRange(&exited, (size_t)((const byte*)r - BVGetPointer(&exited, 0)),
+                          sizeof(*r));
+            if (DEBUG_SPAWN)
+            {
+                recordExit(pid);
+            }
+            return pid;
+        }
+    }
+    return 0;
+}
+
+void SpawnPrintStatistics(void)
+{
+    size_t count = BVSize(&latencies) / sizeof(ulong);
+    ulong *l = (ulong*)BVGetPointer(&latencies, 0);
+    double seconds = (double)(lastExit - firstStart) / 1e6;
+
+    if (!count)
+    {
+        return;
+    }
+    qsort(l, count, sizeof(*l), compareLatency);
+    fprintf(stderr, "spawn: %lu processes, %.0f/s, start to exit p50 %luus p99 %luus\n",
+            (ulong)count, seconds > 0 ? (double)count / seconds : 0.0,
+            l[count / 2], l[count * 99 / 100]);
+}
@@ -0,0 +1,29 @@
+struct rusage;
+
+/*
+  Starts the spawn helper if USE_SPAWN_HELPER is set. Should be called before the process has
+  grown, since the helper is forked from it. Processes are then started by the helper, so that
+  starting them doesn't get slower as the heap grows, and doesn't involve forking this process.
+  Processes run in the working directory this process has when SpawnInit is called. PipeInit must
+  have been called.
+*/
+void SpawnInit(void);
+void SpawnDispose(void);
+
+/*
+  Starts executable with stdin, stdout and stderr redirected to fdIn, fdOut and fdErr. The
+  process gets its own process group unless it is reading from a terminal. With jobserverClient,
+  it inherits the file descriptors of the jobserver (see JobserverGetClientFDs). Returns the pid.
+*/
+nonnull int SpawnProcess(const char *executable, char *const argv[], const char *const envp[],
+                         int fdIn, int fdOut, int fdErr, bool jobserverClient);
+
+/*
+  Returns pid if the process has exited, after setting status and usage like wait4. Returns 0 if
+  the process is still running.
+*/
+nonnull int SpawnReap(int pid, int *status, struct rusage *usage);
+
+/* Prints the number of processes started per second, and percentiles of the time from starting a
+   process to reaping it. Only available with DEBUG_SPAWN. */
+void SpawnPrintStatistics(void);
@@ -0,0 +1,211 @@
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "fail.h"
+#include "pipe.h"
+#include "task.h"
+
+/* The tasks mostly wait for the disk, so there is no need for a thread per processor. */
+#define THREAD_COUNT 4
+
+typedef enum
+{
+    TASK_FREE,
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_FINISHED
+} TaskState;
+
+typedef struct
+{
+    TaskState state;
+    TaskFunction function;
+    void *data;
+    int error;
+} Task;
+
+/* Guarded by mutex, since the threads update the state of the tasks they run. */
+static Task *tasks;
+static uint taskCount;
+#if HAVE_PTHREAD
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[THREAD_COUNT];
+static uint threadCount;
+static bool stopping;
+/* A byte is written to notifyPipe[1] for each finished task, to wake up PipeProcess. */
+static int notifyPipe[2] = {-1, -1};
+#endif
+
+
+#if HAVE_PTHREAD
+static void *threadMain(void *argument unused)
+{
+    uint i;
+    Task *task;
+    TaskFunction function;
+    void *data;
+    int error;
+    byte b = 0;
+
+    pthread_mutex_lock(&mutex);
+    for (;;)
+    {
+        for (i = 0; i < taskCount && tasks[i].state != TASK_QUEUED; i++);
+        if (i == taskCount)
+        {
+            if (stopping)
+            {
+                break;
+            }
+            pthread_cond_wait(&queued, &mutex);
+            continue;
+        }
+        task = &tasks[i];
+        task->state = TASK_RUNNING;
+        function = task->function;
+        data = task->data;
+        pthread_mutex_unlock(&mutex);
+
+        error = function(data);
+
+        pthread_mutex_lock(&mutex);
+        /* tasks may have been reallocated meanwhile. */
+        tasks[i].error = error;
+        tasks[i].state = TASK_FINISHED;
+        while (write(notifyPipe[1], &b, 1) < 0 && errno == EINTR);
+    }
+    pthread_mutex_unlock(&mutex);
+    return null;
+}
+
+static void startThreads(void)
+{
+#if HAVE_PIPE2
+    if (unlikely(pipe2(notifyPipe, O_CLOEXEC | O_NONBLOCK)))
+    {
+        FailErrno(false);
+    }
+#else
+    if (unlikely(pipe(notifyPipe)))
+    {
+        FailErrno(false);
+    }
+    fcntl(notifyPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(notifyPipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK);
+#endif
+    PipeWatchInput(notifyPipe[0]);
+    for (threadCount = 0; threadCount < THREAD_COUNT; threadCount++)
+    {
+        if (unlikely(pthread_create(&threads[threadCount], null, threadMain, null)))
+        {
+            if (!threadCount)
+            {
+                Fail("Error starting thread");
+            }
+            break;
+        }
+    }
+}
+#endif
+
+
+void TaskDispose(void)
+{
+#if HAVE_PTHREAD
+    uint i;
+
+    if (!threadCount)
+    {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&mutex);
+    for (i = 0; i < threadCount; i++)
+    {
+        pthread_join(threads[i], null);
+    }
+    threadCount = 0;
+    close(notifyPipe[0]);
+    close(notifyPipe[1]);
+#endif
+    free(tasks);
+    tasks = null;
+    taskCount = 0;
+}
+
+int TaskStart(TaskFunction function, void *data)
+{
+    uint i;
+
+#if HAVE_PTHREAD
+    if (!threadCount)
+    {
+        startThreads();
+    }
+    pthread_mutex_lock(&mutex);
+#endif
+    for (i = 0; i < taskCount && tasks[i].state != TASK_FREE; i++);
+    if (i == taskCount)
+    {
+        taskCount = taskCount ? taskCount * 2 : THREAD_COUNT;
+        tasks = (Task*)realloc(tasks, taskCount * sizeof(*tasks));
+        if (!tasks)
+        {
+            FailOOM();
+        }
+        memset(tasks + i, 0, (taskCount - i) * sizeof(*tasks));
+    }
+    tasks[i].function = function;
+    tasks[i].data = data;
+#if HAVE_PTHREAD
+    tasks[i].state = TASK_QUEUED;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&mutex);
+#else
+    tasks[i].error = function(data);
+    tasks[i].state = TASK_FINISHED;
+#endif
+    return (int)i;
+}
+
+void TaskProcess(void)
+{
+#if HAVE_PTHREAD
+    byte buffer[64];
+    if (threadCount)
+    {
+        while (read(notifyPipe[0], buffer, sizeof(buffer)) > 0);
+    }
+#endif
+}
+
+bool TaskReap(int task, int *error)
+{
+    bool finished;
+
+    assert(task >= 0 && (uint)task < taskCount);
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&mutex);
+#endif
+    finished = tasks[task].state == TASK_FINISHED;
+    if (finished)
+    {
+        *error = tasks[task].error;
+        tasks[task].state = TASK_FREE;
+    }
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&mutex);
+#endif
+    return finished;
+}
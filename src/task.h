@@ -0,0 +1,23 @@
+/*
+  Tasks run blocking work, like reading or deleting large files, on a pool of threads, so that VMs
+  and jobs running processes can go on meanwhile. A task function must not use values, the heap,
+  the file table or anything else that isn't thread safe, and reports errors by returning an errno
+  value instead of failing. Jobs run tasks with JobAddTask.
+*/
+
+typedef int (*TaskFunction)(void *data);
+
+/* Waits for running tasks and stops the threads. */
+void TaskDispose(void);
+
+/* Runs function with data on a thread. Returns a handle for TaskReap. */
+nonnull int TaskStart(TaskFunction function, void *data);
+
+/* Handles the notifications of finished tasks. Should be called whenever PipeProcess returns. */
+void TaskProcess(void);
+
+/*
+  Returns true if the task has finished, after setting error to what its function returned. The
+  handle is then free.
+*/
+nonnull bool TaskReap(int task, int *error);
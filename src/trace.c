@@ -0,0 +1,188 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "bytevector.h"
+#include "cache.h"
+#include "env.h"
+#include "file.h"
+#include "intvector.h"
+#include "trace.h"
+#include "value.h"
+
+static char *library;
+static const char *traceData; /* For compareEntries. */
+
+
+/* Entries are offsets of lines in traceData, each starting with 'r' or 'w'. */
+static int compareEntries(const void *e1, const void *e2)
+{
+    const char *line1 = traceData + *(const int*)e1;
+    const char *line2 = traceData + *(const int*)e2;
+    int result = strcmp(line1 + 1, line2 + 1);
+    return result ? result : *line1 - *line2;
+}
+
+static bool isIgnored(const char *path, size_t length)
+{
+    return !strncmp(path, "/dev/", 5) || !strncmp(path, "/proc/", 6) ||
+        !strncmp(path, "/sys/", 5) || CacheContainsPath(path, length);
+}
+
+
+void TraceInit(void)
+{
+    const char *value;
+    size_t length;
+
+    EnvGet("DON_TRACE_LIBRARY", 17, &value, &length);
+    if (length)
+    {
+        library = (char*)malloc(length + 1);
+        memcpy(library, value, length);
+        library[length] = 0;
+    }
+    else
+    {
+        library = (char*)malloc(sizeof(DATADIR "dontrace.so"));
+        strcpy(library, DATADIR "dontrace.so");
+    }
+    if (access(library, R_OK))
+    {
+        free(library);
+        library = null;
+    }
+}
+
+void TraceDispose(void)
+{
+    free(library);
+}
+
+bool TraceAvailable(void)
+{
+    return library != null;
+}
+
+char *TraceCreate(void)
+{
+    const char *tmp = getenv("TMPDIR");
+    char *path;
+    int fd;
+
+    tmp = tmp && *tmp ? tmp : "/tmp";
+    path = (char*)malloc(strlen(tmp) + 20);
+    sprintf(path, "%s/don-trace-XXXXXX", tmp);
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        free(path);
+        return null;
+    }
+    close(fd);
+    return path;
+}
+
+vref TraceEnv(vref env, const char *path)
+{
+    vref values[4];
+    const char *preload;
+    size_t preloadLength;
+    size_t libraryLength = strlen(library);
+    char *data;
+
+    assert(library);
+    EnvGet("LD_PRELOAD", 10, &preload, &preloadLength);
+    values[0] = VCreateString("LD_PRELOAD", 10);
+    values[1] = VCreateUninitialisedString(libraryLength + (preloadLength ? preloadLength + 1 : 0),
+                                           &data);
+    memcpy(data, library, libraryLength);
+    if (preloadLength)
+    {
+        data[libraryLength] = ' ';
+        memcpy(data + libraryLength + 1, preload, preloadLength);
+    }
+    values[2] = VCreateString("DON_TRACE", 9);
+    values[3] = VCreateString(path, strlen(path));
+    return VConcat(null, env, VCreateArrayFromData(values, 4));
+}
+
+vref TraceRead(char *path)
+{
+    File file;
+    char *data;
+    char *line;
+    char *end;
+    size_t size;
+    size_t length;
+    size_t i;
+    intvector entries;
+    intvector files;
+    const char *entry;
+    bool written;
+    vref result;
+
+    if (!FileTryOpen(&file, path, strlen(path)))
+    {
+        free(path);
+        return VEmptyList;
+    }
+    size = FileSize(&file);
+    data = (char*)malloc(size + 1);
+    if (size)
+    {
+        FileRead(&file, (byte*)data, size);
+    }
+    data[size] = 0;
+    FileClose(&file);
+    FileDelete(path, strlen(path));
+    free(path);
+
+    /* Lines are terminated and cleaned in place. */
+    IVInit(&entries, 64);
+    for (line = data; line < data + size; line = end + 1)
+    {
+        end = strchr(line, '\n');
+        if (!end)
+        {
+            break;
+        }
+        *end = 0;
+        if ((*line == 'r' || *line == 'w') && line[1] == '/')
+        {
+            /* Compilers look for directories that don't exist with a trailing slash. */
+            length = FileCleanPath(line + 1, (size_t)(end - line - 1));
+            if (length > 1 && line[length] == '/')
+            {
+                line[length] = 0;
+            }
+            IVAdd(&entries, (int)(line - data));
+        }
+    }
+    traceData = data;
+    qsort(IVGetWritePointer(&entries, 0), IVSize(&entries), sizeof(int), compareEntries);
+
+    /* Each path is listed once, with the 'r' entries before the 'w' entries. */
+    IVInit(&files, 64);
+    for (i = 0; i < IVSize(&entries);)
+    {
+        entry = data + IVGet(&entries, i);
+        written = false;
+        for (; i < IVSize(&entries) && !strcmp(data + IVGet(&entries, i) + 1, entry + 1); i++)
+        {
+            written = written || data[IVGet(&entries, i)] == 'w';
+        }
+        length = strlen(entry + 1);
+        if (!written && !isIgnored(entry + 1, length))
+        {
+            IVAdd(&files, intFromRef(VCreatePathUnchecked(VCreateString(entry + 1, length))));
+        }
+    }
+    result = IVSize(&files) ? VCreateArrayFromVector(&files) : VEmptyList;
+    IVDispose(&files);
+    IVDispose(&entries);
+    free(data);
+    return result;
+}
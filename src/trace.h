@@ -0,0 +1,28 @@
+/*
+  Tracing of the files processes access, with the library built from preload/dontrace.c. The
+  library is DON_TRACE_LIBRARY if set, or dontrace.so in the data directory. EnvInit and CacheInit
+  must have been called.
+*/
+void TraceInit(void);
+void TraceDispose(void);
+
+/* Returns true if the tracing library exists. */
+bool TraceAvailable(void);
+
+/*
+  Creates an empty file for a process to write its trace to. Returns the path, to be passed to
+  TraceEnv and TraceRead, or null on errors.
+*/
+char *TraceCreate(void);
+
+/*
+  Returns env with the variables added that make processes preload the tracing library and
+  write to the trace file at path.
+*/
+nonnull vref TraceEnv(vref env, const char *path);
+
+/*
+  Deletes the trace file and frees path. Returns the files that were read, but not written, by the
+  traced processes, except files in the cache directory, /dev, /proc and /sys.
+*/
+nonnull vref TraceRead(char *path);
@@ -1,4 +1,5 @@
 #include "config.h"
+#include <time.h>
 #include "common.h"
 #include "util.h"
 
@@ -97,3 +98,17 @@ size_t UtilCountNewlines(const char *text, size_t length)
     }
     return newlines;
 }
+
+ulong UtilTimeMillis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ulong)ts.tv_sec * 1000 + (ulong)ts.tv_nsec / 1000000;
+}
+
+ulong UtilTimeMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ulong)ts.tv_sec * 1000000 + (ulong)ts.tv_nsec / 1000;
+}
@@ -3,3 +3,6 @@ nonnull void UtilBase32(const byte *restrict data, int size, char *restrict outp
 /* data and output may overlap. */
 nonnull void UtilDecodeBase32(const char *data, int size, byte *output);
 size_t UtilCountNewlines(const char *text, size_t length);
+/* Milliseconds from an arbitrary point in time, unaffected by changes to the system clock. */
+ulong UtilTimeMillis(void);
+ulong UtilTimeMicros(void);
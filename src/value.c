@@ -53,6 +53,9 @@ static const char *getString(vref object)
         ss = (const SubString*)HeapGetObjectData(object);
         return &getString(ss->string)[ss->offset];
 
+    case TYPE_EXTERNAL_STRING:
+        return ((const ExternalString*)HeapGetObjectData(object))->data;
+
     case TYPE_FILE:
         return getString(unboxReference(TYPE_FILE, object));
     }
@@ -119,6 +122,7 @@ char *VDebug(vref value)
     case TYPE_BOOLEAN_FALSE:         type = "false";          string = false; break;
     case TYPE_STRING:                type = "string";                         break;
     case TYPE_SUBSTRING:             type = "substring";                      break;
+    case TYPE_EXTERNAL_STRING:       type = "external_string";                break;
     case TYPE_FILE:                  type = "file";                           break;
     case TYPE_ARRAY:                 type = "array";                          break;
     case TYPE_INTEGER_RANGE:         type = "range";                          break;
@@ -217,6 +221,7 @@ void VHash(vref object, HashState *hash)
 
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
         value = TYPE_STRING;
         HashUpdate(hash, &value, 1);
         HashUpdate(hash, (const byte*)getString(object),
@@ -249,6 +254,28 @@ void VHash(vref object, HashState *hash)
     unreachable;
 }
 
+bool VIsKnown(vref value)
+{
+    size_t index;
+    vref item;
+
+    if (value == VFuture)
+    {
+        return false;
+    }
+    if (VIsCollection(value))
+    {
+        for (index = 0; VCollectionGet(value, VBoxSize(index++), &item);)
+        {
+            if (!VIsKnown(item))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 VBool VGetBool(vref value)
 {
     switch (HeapGetObjectType(value))
@@ -265,6 +292,7 @@ VBool VGetBool(vref value)
 
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
         return VStringLength(value) ? TRUTHY : FALSY;
 
     case TYPE_ARRAY:
@@ -353,6 +381,7 @@ bool VIsStringType(VType type)
 
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
         return true;
 
     case TYPE_INVALID:
@@ -409,6 +438,9 @@ size_t VStringLength(vref value)
     case TYPE_SUBSTRING:
         return ((const SubString*)ho.data)->length;
 
+    case TYPE_EXTERNAL_STRING:
+        return ((const ExternalString*)ho.data)->length;
+
     case TYPE_FILE:
         return VStringLength(*(ref_t*)ho.data);
 
@@ -482,6 +514,7 @@ vref VCreateSubstring(vref string, size_t offset, size_t length)
     switch ((int)type)
     {
     case TYPE_STRING:
+    case TYPE_EXTERNAL_STRING:
         break;
 
     case TYPE_SUBSTRING:
@@ -501,6 +534,20 @@ vref VCreateSubstring(vref string, size_t offset, size_t length)
     return HeapFinishAlloc(data);
 }
 
+vref VCreateExternalString(const char *string, size_t length)
+{
+    ExternalString *es;
+
+    if (!length)
+    {
+        return VEmptyString;
+    }
+    es = (ExternalString*)HeapAlloc(TYPE_EXTERNAL_STRING, sizeof(ExternalString));
+    es->data = string;
+    es->length = length;
+    return HeapFinishAlloc((byte*)es);
+}
+
 vref VCreateStringFormatted(const char *format, va_list ap)
 {
     /* TODO: Calculate size first - make sure it fits on heap. */
@@ -589,6 +636,19 @@ const char *VGetString(vref object)
     return (const char*)HeapGetObjectData(object);
 }
 
+const char *VGetStringData(vref value)
+{
+    VType type = HeapGetObjectType(value);
+    switch ((int)type)
+    {
+    case TYPE_STRING:
+    case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
+        return getString(value);
+    }
+    return null;
+}
+
 char *VGetStringCopy(vref object)
 {
     size_t length = VStringLength(object);
@@ -663,6 +723,11 @@ char *VWriteString(vref value, char *dst)
         subString = (const SubString*)ho.data;
         return VWriteSubstring(subString->string, subString->offset, subString->length, dst);
 
+    case TYPE_EXTERNAL_STRING:
+        memcpy(dst, ((const ExternalString*)ho.data)->data,
+               ((const ExternalString*)ho.data)->length);
+        return dst + ((const ExternalString*)ho.data)->length;
+
     case TYPE_FILE:
         return VWriteString(*(vref*)ho.data, dst);
 
@@ -1014,6 +1079,36 @@ vref VCreateFilelistGlob(const char *pattern, size_t length)
     return VFinishArray(array);
 }
 
+bool VFilelistOverlaps(vref files, const char *path, size_t length)
+{
+    size_t index;
+    vref value;
+
+    if (files == VFuture)
+    {
+        return true;
+    }
+    for (index = 0; VCollectionGet(files, VBoxSize(index++), &value);)
+    {
+        size_t fileLength;
+        const char *file = VGetPath(value, &fileLength);
+        size_t commonLength = min(fileLength, length);
+        if (memcmp(file, path, commonLength))
+        {
+            continue;
+        }
+        /* One path is a prefix of the other. They overlap if the shorter one is a directory
+           containing the other. */
+        if (fileLength == length ||
+            (fileLength < length ? file : path)[commonLength - 1] == '/' ||
+            (fileLength < length ? path : file)[commonLength] == '/')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 
 vref *VCreateArray(size_t size)
 {
@@ -1064,6 +1159,7 @@ bool VIsCollectionType(VType type)
     case TYPE_INTEGER:
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
     case TYPE_FILE:
         return false;
 
@@ -1220,6 +1316,7 @@ vref VEquals(vref value1, vref value2)
 
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
         if (!VIsStringType(type2))
         {
             return VFalse;
@@ -1541,6 +1638,7 @@ vref VIndexedAccess(VM *vm, vref value1, vref value2)
 
     case TYPE_STRING:
     case TYPE_SUBSTRING:
+    case TYPE_EXTERNAL_STRING:
         if (indexType == TYPE_INTEGER_RANGE)
         {
             size_t size1 = VUnboxSize(VRangeLow(value2));
@@ -11,7 +11,8 @@ typedef enum
     TYPE_ARRAY,
     TYPE_INTEGER_RANGE,
     TYPE_CONCAT_LIST,
-    TYPE_FUTURE
+    TYPE_FUTURE,
+    TYPE_EXTERNAL_STRING
 } VType;
 
 typedef enum
@@ -43,6 +44,9 @@ nonnull void VHash(vref object, HashState *hash);
 
 VBool VGetBool(vref value);
 
+/* Returns false if the value is VFuture or a collection containing VFuture. */
+bool VIsKnown(vref value);
+
 /*
   Returns true if the value is truthy.
   Returns false if true value if falsy or not yet known.
@@ -77,6 +81,8 @@ size_t VStringLength(vref value);
 nonnull vref VCreateString(const char *string, size_t length);
 nonnull vref VCreateUninitialisedString(size_t length, char **data);
 nonnull vref VCreateSubstring(vref string, size_t offset, size_t length);
+/* Creates a string of data outside the heap, which must stay valid and be followed by a 0 byte. */
+nonnull vref VCreateExternalString(const char *data, size_t length);
 nonnull vref VCreateStringFormatted(const char *format, va_list ap);
 
 /*
@@ -86,6 +92,12 @@ nonnull vref VCreateStringFormatted(const char *format, va_list ap);
 */
 nonnull const char *VGetString(vref object);
 nonnull char *VGetStringCopy(vref object);
+/*
+  Returns the characters of a string value stored in one piece, which stay unchanged for the rest
+  of the run. Returns null for other values, which have to be converted with VWriteString. The
+  string is not necessarily null-terminated.
+*/
+nonnull const char *VGetStringData(vref value);
 
 /*
   Converts the object to a string and writes it to dst. The written string will
@@ -110,6 +122,11 @@ nonnull vref VPathFromParts(vref path, vref name, vref extension);
 
 nonnull vref VCreateFilelist(vref value);
 nonnull vref VCreateFilelistGlob(const char *pattern, size_t length);
+/*
+  Returns true if any file in the filelist is path, a directory containing path, or contained in
+  the directory path. A future filelist is assumed to overlap everything.
+*/
+nonnull bool VFilelistOverlaps(vref files, const char *path, size_t length);
 
 
 nonnull vref *VCreateArray(size_t size);
@@ -5,14 +5,19 @@
 #include "common.h"
 #include "bytecode.h"
 #include "debug.h"
+#include "hash.h"
 #include "linker.h"
 #include "instruction.h"
 #include "job.h"
 #include "value.h"
 #include "vm.h"
 
+/* Upper limit for the number of VMs. Speculative execution stops forking new VMs when reached. */
+#define MAX_VM_COUNT 256
+
 const int *vmBytecode;
 const int *vmLineNumbers;
+static uint vmCount;
 
 static VM *VMAlloc(int fieldCount)
 {
@@ -22,6 +27,7 @@ static VM *VMAlloc(int fieldCount)
     vm->fieldCount = fieldCount;
     IVInit(&vm->callStack, 128);
     IVInit(&vm->stack, 1024);
+    vmCount++;
     return vm;
 }
 
@@ -35,6 +41,7 @@ VM *VMCreate(const LinkedProgram *program)
     vm->constants = program->constants;
     vm->constantCount = program->constantCount;
     vm->bp = 0;
+    vm->skippedFiles = VEmptyList;
     memcpy(vm->fields, program->fields, (uint)vm->fieldCount * sizeof(*vm->fields));
     return vm;
 }
@@ -49,9 +56,17 @@ static void VMCloneInit(const VM *vm, VM *clone, const int *ip)
     IVAppendAll(&vm->stack, &clone->stack);
     clone->ip = ip;
     clone->bp = vm->bp;
+    clone->skippedFiles = vm->skippedFiles;
+    clone->stepEstimate = vm->stepEstimate;
+    clone->stepTime = vm->stepTime;
     clone->base.clonePoints = vm->base.clonePoints;
 }
 
+bool VMCloneAllowed(void)
+{
+    return vmCount < MAX_VM_COUNT;
+}
+
 VM *VMClone(VM *vm, const int *ip)
 {
     VM *clone = VMAlloc(vm->fieldCount);
@@ -173,6 +188,8 @@ void VMDispose(VMBase *base)
         IVDispose(&vm->callStack);
         IVDispose(&vm->stack);
         free(vm);
+        assert(vmCount);
+        vmCount--;
         if (base)
         {
             VMDispose(base);
@@ -236,7 +253,6 @@ void VMHalt(VM *vm, vref failMessage)
     }
     if (vm->child)
     {
-        assert(vm->child->fullVM);
         VMDispose(vm->child);
         vm->child = null;
     }
@@ -244,6 +260,17 @@ void VMHalt(VM *vm, vref failMessage)
     vm->failMessage = failMessage;
 }
 
+void VMSkipModification(VM *vm, vref files)
+{
+    assert(vm->base.parent);
+    if (files == VFuture || vm->skippedFiles == VFuture)
+    {
+        vm->skippedFiles = VFuture;
+        return;
+    }
+    vm->skippedFiles = VConcat(vm, vm->skippedFiles, VCreateFilelist(files));
+}
+
 void VMFail(VM *vm, const char *msg, size_t msgSize)
 {
     VMHalt(vm, VCreateString(msg, msgSize));
@@ -257,6 +284,14 @@ void VMFailf(VM *vm, const char *format, ...)
     va_end(args);
 }
 
+uint VMCallerReturnValueCount(const VM *vm)
+{
+    size_t size = IVSize(&vm->callStack);
+    /* The call stack holds the return address and base pointer of each caller. The return
+       address points at the number of values stored. */
+    return size ? (uint)vmBytecode[IVGet(&vm->callStack, size - 2)] : 0;
+}
+
 
 vref VMReadValue(VM *vm)
 {
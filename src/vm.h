@@ -35,6 +35,16 @@ struct VM
     struct _Job *job;
     VMBase *child;
     vref failMessage;
+
+    /* Files modified by side effects this speculatively executing VM has skipped. VFuture if
+       unknown. */
+    vref skippedFiles;
+
+    /* Recorded duration (ms) of the cache step being executed, or 0 if unknown. Used to start
+       the jobs of long steps first. */
+    ulong stepEstimate;
+    /* Time (ms) spent running jobs since the cache step started. */
+    ulong stepTime;
 };
 
 
@@ -42,6 +52,7 @@ extern const int *vmBytecode;
 extern const int *vmLineNumbers;
 
 nonnull VM *VMCreate(const struct _LinkedProgram *program);
+bool VMCloneAllowed(void);
 nonnull VM *VMClone(VM *vmState, const int *ip);
 nonnull void VMCloneBranch(VM *vmState, const int *ip);
 nonnull void VMReplaceCloneBranch(VM *vmState, const int *ip);
@@ -49,8 +60,12 @@ nonnull void VMDispose(VMBase *base);
 nonnull VMBase *VMDisposeBranch(VMBranch *branch, uint keepBranch);
 nonnull void VMReplaceChild(VM *vm, VM *child);
 nonnull void VMHalt(VM *vm, vref failMessage);
+nonnull void VMSkipModification(VM *vm, vref files);
 nonnull void VMFail(VM *vm, const char *msg, size_t msgSize);
 attrprintf(2, 3) void VMFailf(VM *vm, const char *format, ...);
 
+/* Returns how many of the return values of the current function its caller uses. */
+nonnull uint VMCallerReturnValueCount(const VM *vm);
+
 nonnull vref VMReadValue(VM *vmState);
 nonnull void VMStoreValue(VM *vmState, int variable, vref value);
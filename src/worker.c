@@ -0,0 +1,1299 @@
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if HAVE_PIDFD
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+#include "common.h"
+#include "bytevector.h"
+#include "fail.h"
+#include "file.h"
+#include "hash.h"
+#include "pipe.h"
+#include "value.h"
+#include "worker.h"
+
+/*
+  A message is a type, followed by the size of the rest of the message. Numbers are 8 bytes, least
+  significant byte first. Data is a number with its size, followed by the bytes. Strings are data
+  including the terminating zero.
+
+  MESSAGE_REQUEST: cwd, executable, argument count, arguments, environment count, environment,
+  stdin data, input count, inputs (path and digest), output count, outputs (path).
+  MESSAGE_MISSING: count, indices of the inputs the worker needs the contents of.
+  MESSAGE_CONTENTS: count, index and data of each input asked for.
+  MESSAGE_KILL: signal.
+  MESSAGE_DONE: wait status, user and system time (us), max RSS (kB), block input and output
+  operations, voluntary and involuntary context switches, stdout data, stderr data, and for each
+  output: 1 followed by the data of the file, or 0 if it isn't a file.
+*/
+#define MESSAGE_REQUEST 'R'
+#define MESSAGE_MISSING 'M'
+#define MESSAGE_CONTENTS 'C'
+#define MESSAGE_KILL 'K'
+#define MESSAGE_DONE 'D'
+
+#define NUMBER_SIZE 8
+#define HEADER_SIZE (1 + NUMBER_SIZE)
+#define RECEIVE_SIZE (64 * 1024)
+/* Milliseconds between checks for the process having exited, if its exit can't be watched for. */
+#define REAP_INTERVAL 10
+
+typedef struct
+{
+    const byte *data;
+    size_t size;
+    bool invalid; /* Set if reading past the end. */
+} Reader;
+
+typedef struct
+{
+    char *address;
+    int fd;
+    bool busy;
+    bool exited; /* MESSAGE_DONE has been received. */
+    bytevector received;
+    bytevector inputs; /* Zero terminated paths of the inputs of the running process. */
+    bytevector outputs; /* Zero terminated paths of the outputs of the running process. */
+    bytevector result; /* MESSAGE_DONE, without the header. */
+    int fdOut;
+    int fdErr;
+    size_t outPos; /* Offsets of the output not yet written in result. */
+    size_t outEnd;
+    size_t errPos;
+    size_t errEnd;
+    int status;
+    struct rusage usage;
+} Worker;
+
+static Worker *workers;
+static uint workerCount;
+static bytevector message;
+
+
+static void addNumber(bytevector *buffer, ulong value)
+{
+    uint i;
+    for (i = 0; i < NUMBER_SIZE; i++)
+    {
+        BVAdd(buffer, (byte)value);
+        value >>= 8;
+    }
+}
+
+static void setNumber(bytevector *buffer, size_t offset, ulong value)
+{
+    byte *p = BVGetWritePointer(buffer, offset);
+    uint i;
+    for (i = 0; i < NUMBER_SIZE; i++)
+    {
+        *p++ = (byte)value;
+        value >>= 8;
+    }
+}
+
+static void addData(bytevector *buffer, const byte *data, size_t size)
+{
+    addNumber(buffer, size);
+    BVAddData(buffer, data, size);
+}
+
+static void addString(bytevector *buffer, const char *string, size_t length)
+{
+    addNumber(buffer, length + 1);
+    BVAddData(buffer, (const byte*)string, length);
+    BVAdd(buffer, 0);
+}
+
+static ulong readNumber(Reader *reader)
+{
+    ulong value = 0;
+    uint i;
+    if (reader->size < NUMBER_SIZE)
+    {
+        reader->invalid = true;
+        return 0;
+    }
+    for (i = NUMBER_SIZE; i--;)
+    {
+        value = value << 8 | reader->data[i];
+    }
+    reader->data += NUMBER_SIZE;
+    reader->size -= NUMBER_SIZE;
+    return value;
+}
+
+static const byte *readData(Reader *reader, size_t *size)
+{
+    const byte *data;
+    *size = (size_t)readNumber(reader);
+    if (*size > reader->size)
+    {
+        reader->invalid = true;
+        *size = 0;
+    }
+    data = reader->data;
+    reader->data += *size;
+    reader->size -= *size;
+    return data;
+}
+
+static const char *readString(Reader *reader)
+{
+    size_t size;
+    const char *string = (const char*)readData(reader, &size);
+    if (!size || string[size - 1])
+    {
+        reader->invalid = true;
+        return "";
+    }
+    return string;
+}
+
+static void initReader(Reader *reader, const byte *data, size_t size)
+{
+    reader->data = data;
+    reader->size = size;
+    reader->invalid = false;
+}
+
+static void beginMessage(bytevector *buffer, byte type)
+{
+    BVSetSize(buffer, 0);
+    BVAdd(buffer, type);
+    addNumber(buffer, 0);
+}
+
+/* Returns false if the connection has been lost. */
+static bool writeAll(int fd, const byte *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t writeSize = send(fd, data, size, MSG_NOSIGNAL);
+        if (writeSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += writeSize;
+        size -= (size_t)writeSize;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, bytevector *buffer)
+{
+    setNumber(buffer, 1, BVSize(buffer) - HEADER_SIZE);
+    return writeAll(fd, BVGetPointer(buffer, 0), BVSize(buffer));
+}
+
+/*
+  Returns a socket connected to address, or listening on it if server is true, or -1 on errors. A
+  Unix socket is listening before it appears at its path, so that clients can wait for the path.
+*/
+static int openSocket(const char *address, bool server)
+{
+    struct sockaddr_un unixAddress;
+    struct sockaddr_in ipv4Address;
+    struct sockaddr_in6 ipv6Address;
+    struct sockaddr *tcpAddress;
+    socklen_t tcpAddressLength;
+    const char *colon;
+    char host[INET6_ADDRSTRLEN];
+    char *end;
+    long port;
+    char *temporaryPath;
+    int fd = -1;
+    int one = 1;
+
+    if (!strncmp(address, "unix:", 5))
+    {
+        address += 5;
+        memset(&unixAddress, 0, sizeof(unixAddress));
+        unixAddress.sun_family = AF_UNIX;
+        if (strlen(address) + 16 >= sizeof(unixAddress.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (!server)
+        {
+            strcpy(unixAddress.sun_path, address);
+            if (connect(fd, (struct sockaddr*)&unixAddress, sizeof(unixAddress)))
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+        sprintf(unixAddress.sun_path, "%s.%ld", address, (long)getpid());
+        temporaryPath = unixAddress.sun_path;
+        unlink(temporaryPath);
+        if (bind(fd, (struct sockaddr*)&unixAddress, sizeof(unixAddress)) ||
+            listen(fd, 16) || rename(temporaryPath, address))
+        {
+            unlink(temporaryPath);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /* The address is parsed without getaddrinfo, which can't be used in a static build. */
+    colon = strrchr(address, ':');
+    port = colon ? strtol(colon + 1, &end, 10) : 0;
+    if (!colon || !colon[1] || *end || port <= 0 || port > 65535 ||
+        (size_t)(colon - address) >= sizeof(host))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    host[colon - address] = 0;
+    memset(&ipv4Address, 0, sizeof(ipv4Address));
+    memset(&ipv6Address, 0, sizeof(ipv6Address));
+    ipv4Address.sin_family = AF_INET;
+    ipv4Address.sin_port = htons((unsigned short)port);
+    ipv6Address.sin6_family = AF_INET6;
+    ipv6Address.sin6_port = htons((unsigned short)port);
+    if (!*host || inet_pton(AF_INET, host, &ipv4Address.sin_addr) == 1)
+    {
+        if (!*host)
+        {
+            ipv4Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
+        tcpAddress = (struct sockaddr*)&ipv4Address;
+        tcpAddressLength = sizeof(ipv4Address);
+    }
+    else if (inet_pton(AF_INET6, host, &ipv6Address.sin6_addr) == 1)
+    {
+        tcpAddress = (struct sockaddr*)&ipv6Address;
+        tcpAddressLength = sizeof(ipv6Address);
+    }
+    else
+    {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    fd = socket(tcpAddress->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (server)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, tcpAddress, tcpAddressLength) || listen(fd, 16))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        if (connect(fd, tcpAddress, tcpAddressLength))
+        {
+            close(fd);
+            return -1;
+        }
+        /* Messages are small and answered one at a time. */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+/* Returns the contents of the file at path in a new buffer, or null if it isn't a file. */
+static byte *readFile(const char *path, size_t *size)
+{
+    File file;
+    struct stat s;
+    byte *data;
+
+    if (!FileTryOpen(&file, path, strlen(path)))
+    {
+        return null;
+    }
+    if (fstat(file.fd, &s) || !S_ISREG(s.st_mode))
+    {
+        FileClose(&file);
+        return null;
+    }
+    *size = FileSize(&file);
+    data = (byte*)malloc(*size + 1);
+    if (*size)
+    {
+        FileRead(&file, data, *size);
+    }
+    FileClose(&file);
+    return data;
+}
+
+/* Returns the path at index in a list of zero terminated strings. */
+static const char *getPath(const bytevector *paths, size_t index)
+{
+    const char *path = (const char*)BVGetPointer(paths, 0);
+    const char *stop = path + BVSize(paths);
+    for (; index && path < stop; index--)
+    {
+        path += strlen(path) + 1;
+    }
+    return path < stop ? path : null;
+}
+
+/*
+  Adds the inputs (with their digests) or outputs to the request, and their paths to paths.
+  Anything that isn't a file, like a directory, is left out.
+*/
+static void addFiles(bytevector *paths, vref files, bool digest)
+{
+    byte hash[DIGEST_SIZE];
+    size_t countOffset = BVSize(&message);
+    size_t count = 0;
+    size_t index;
+    size_t length;
+    size_t size;
+    const char *path;
+    byte *data;
+    vref value;
+
+    addNumber(&message, 0);
+    BVSetSize(paths, 0);
+    for (index = 0; VCollectionGet(files, VBoxSize(index++), &value);)
+    {
+        if (!VIsFile(value))
+        {
+            continue;
+        }
+        path = VGetPath(value, &length);
+        if (digest)
+        {
+            data = readFile(path, &size);
+            if (!data)
+            {
+                continue;
+            }
+            Hash(data, size, hash);
+            free(data);
+        }
+        addString(&message, path, length);
+        if (digest)
+        {
+            BVAddData(&message, hash, DIGEST_SIZE);
+        }
+        BVAddData(paths, (const byte*)path, length + 1);
+        count++;
+    }
+    setNumber(&message, countOffset, count);
+}
+
+static noreturn void failConnection(const Worker *worker)
+{
+    Fail("don: Lost connection to worker %s\n", worker->address);
+}
+
+static void sendContents(Worker *worker, Reader *reader)
+{
+    size_t count = (size_t)readNumber(reader);
+    size_t size;
+    size_t index;
+    const char *path;
+    byte *data;
+
+    beginMessage(&message, MESSAGE_CONTENTS);
+    addNumber(&message, count);
+    while (count-- && !reader->invalid)
+    {
+        index = (size_t)readNumber(reader);
+        path = getPath(&worker->inputs, index);
+        if (!path)
+        {
+            reader->invalid = true;
+            break;
+        }
+        data = readFile(path, &size);
+        addNumber(&message, index);
+        addData(&message, data, data ? size : 0);
+        free(data);
+    }
+    if (reader->invalid)
+    {
+        Fail("don: Invalid message from worker %s\n", worker->address);
+    }
+    if (!sendMessage(worker->fd, &message))
+    {
+        failConnection(worker);
+    }
+}
+
+static void setTime(struct timeval *time, ulong microseconds)
+{
+    time->tv_sec = (time_t)(microseconds / 1000000);
+    time->tv_usec = (suseconds_t)(microseconds % 1000000);
+}
+
+/* Writes a file the process modified, unless it already has the same contents. */
+static void writeBack(const char *path, const byte *data, size_t size)
+{
+    File file;
+    size_t oldSize;
+    byte *old = readFile(path, &oldSize);
+    bool same = old && oldSize == size && !memcmp(old, data, size);
+    free(old);
+    if (same)
+    {
+        return;
+    }
+    FileOpenAppend(&file, path, strlen(path), true);
+    FileWrite(&file, data, size);
+    FileClose(&file);
+}
+
+static void handleDone(Worker *worker)
+{
+    Reader reader;
+    const byte *base = BVGetPointer(&worker->result, 0);
+    const byte *data;
+    const char *path;
+    size_t size;
+    size_t count;
+    size_t i;
+
+    initReader(&reader, base, BVSize(&worker->result));
+    worker->status = (int)readNumber(&reader);
+    memset(&worker->usage, 0, sizeof(worker->usage));
+    setTime(&worker->usage.ru_utime, readNumber(&reader));
+    setTime(&worker->usage.ru_stime, readNumber(&reader));
+    worker->usage.ru_maxrss = (long)readNumber(&reader);
+    worker->usage.ru_inblock = (long)readNumber(&reader);
+    worker->usage.ru_oublock = (long)readNumber(&reader);
+    worker->usage.ru_nvcsw = (long)readNumber(&reader);
+    worker->usage.ru_nivcsw = (long)readNumber(&reader);
+    data = readData(&reader, &size);
+    worker->outPos = (size_t)(data - base);
+    worker->outEnd = worker->outPos + size;
+    data = readData(&reader, &size);
+    worker->errPos = (size_t)(data - base);
+    worker->errEnd = worker->errPos + size;
+    count = (size_t)readNumber(&reader);
+    for (i = 0; i < count && !reader.invalid; i++)
+    {
+        path = getPath(&worker->outputs, i);
+        if (!path)
+        {
+            reader.invalid = true;
+        }
+        else if (readNumber(&reader))
+        {
+            data = readData(&reader, &size);
+            if (!reader.invalid)
+            {
+                writeBack(path, data, size);
+            }
+        }
+    }
+    if (reader.invalid)
+    {
+        Fail("don: Invalid message from worker %s\n", worker->address);
+    }
+    worker->exited = true;
+}
+
+/* Handles the complete messages received. */
+static void handleMessages(Worker *worker)
+{
+    Reader reader;
+    size_t size;
+    byte type;
+
+    for (;;)
+    {
+        if (BVSize(&worker->received) < HEADER_SIZE)
+        {
+            return;
+        }
+        initReader(&reader, BVGetPointer(&worker->received, 1), NUMBER_SIZE);
+        size = (size_t)readNumber(&reader);
+        reader.size = size;
+        if (BVSize(&worker->received) - HEADER_SIZE < size)
+        {
+            return;
+        }
+        type = BVGet(&worker->received, 0);
+        if (!worker->busy || worker->exited)
+        {
+            Fail("don: Unexpected message from worker %s\n", worker->address);
+        }
+        if (type == MESSAGE_MISSING)
+        {
+            sendContents(worker, &reader);
+        }
+        else if (type == MESSAGE_DONE)
+        {
+            BVSetSize(&worker->result, 0);
+            BVAddData(&worker->result, reader.data, size);
+            handleDone(worker);
+        }
+        else
+        {
+            Fail("don: Invalid message from worker %s\n", worker->address);
+        }
+        BVRemoveRange(&worker->received, 0, HEADER_SIZE + size);
+    }
+}
+
+static void receive(Worker *worker)
+{
+    for (;;)
+    {
+        size_t size = BVSize(&worker->received);
+        byte *data = BVGetAppendPointer(&worker->received, RECEIVE_SIZE);
+        ssize_t readSize = recv(worker->fd, data, RECEIVE_SIZE, MSG_DONTWAIT);
+        BVSetSize(&worker->received, size + (readSize > 0 ? (size_t)readSize : 0));
+        if (readSize > 0)
+        {
+            continue;
+        }
+        if (readSize < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (readSize < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        failConnection(worker);
+    }
+}
+
+/* Writes output to fd without blocking, and closes fd once it has all been written. Output that
+   no longer has a reader is dropped. */
+static void writeOutput(const Worker *worker, int *fd, size_t *pos, size_t end)
+{
+    while (*fd >= 0 && *pos < end)
+    {
+        ssize_t writeSize = write(*fd, BVGetPointer(&worker->result, *pos), end - *pos);
+        if (writeSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                return;
+            }
+            break;
+        }
+        *pos += (size_t)writeSize;
+    }
+    if (*fd >= 0)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+
+void WorkerInit(const char *addresses)
+{
+    const char *p;
+    const char *end;
+    Worker *worker;
+    uint count = 1;
+
+    for (p = addresses; *p; p++)
+    {
+        count += *p == ',';
+    }
+    workers = (Worker*)calloc(count, sizeof(Worker));
+    BVInit(&message, 4096);
+    for (p = addresses; workerCount < count; p = end + 1)
+    {
+        end = strchr(p, ',');
+        if (!end)
+        {
+            end = p + strlen(p);
+        }
+        worker = &workers[workerCount++];
+        worker->address = (char*)malloc((size_t)(end - p) + 1);
+        memcpy(worker->address, p, (size_t)(end - p));
+        worker->address[end - p] = 0;
+        worker->fd = openSocket(worker->address, false);
+        if (worker->fd < 0)
+        {
+            FailIO("Error connecting to worker", worker->address);
+        }
+        worker->fdOut = -1;
+        worker->fdErr = -1;
+        BVInit(&worker->received, RECEIVE_SIZE);
+        BVInit(&worker->inputs, 1024);
+        BVInit(&worker->outputs, 1024);
+        BVInit(&worker->result, 0);
+        PipeWatchInput(worker->fd);
+    }
+}
+
+void WorkerDispose(void)
+{
+    uint i;
+    for (i = 0; i < workerCount; i++)
+    {
+        Worker *worker = &workers[i];
+        close(worker->fd);
+        free(worker->address);
+        BVDispose(&worker->received);
+        BVDispose(&worker->inputs);
+        BVDispose(&worker->outputs);
+        BVDispose(&worker->result);
+    }
+    free(workers);
+    if (workerCount)
+    {
+        BVDispose(&message);
+    }
+    workerCount = 0;
+}
+
+uint WorkerCount(void)
+{
+    return workerCount;
+}
+
+bool WorkerIdle(void)
+{
+    uint i;
+    for (i = 0; i < workerCount; i++)
+    {
+        if (!workers[i].busy)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int WorkerStart(const char *executable, char *const argv[], const char *const envp[],
+                const char *stdinData, size_t stdinSize, int fdOut, int fdErr,
+                vref accessedFiles, vref modifiedFiles)
+{
+    Worker *worker;
+    const char *cwd;
+    size_t length;
+    size_t countOffset;
+    uint handle;
+    uint i;
+
+    for (handle = 0; workers[handle].busy; handle++)
+    {
+        assert(handle + 1 < workerCount);
+    }
+    worker = &workers[handle];
+
+    beginMessage(&message, MESSAGE_REQUEST);
+    cwd = FileGetCWD(&length);
+    addString(&message, cwd, length);
+    addString(&message, executable, strlen(executable));
+    for (i = 0; argv[i]; i++);
+    addNumber(&message, i);
+    for (i = 0; argv[i]; i++)
+    {
+        addString(&message, argv[i], strlen(argv[i]));
+    }
+    countOffset = BVSize(&message);
+    addNumber(&message, 0);
+    for (i = 0; envp[i]; i++)
+    {
+        addString(&message, envp[i], strlen(envp[i]));
+    }
+    setNumber(&message, countOffset, i);
+    addData(&message, (const byte*)stdinData, stdinSize);
+    addFiles(&worker->inputs, accessedFiles, true);
+    addFiles(&worker->outputs, modifiedFiles, false);
+    if (!sendMessage(worker->fd, &message))
+    {
+        failConnection(worker);
+    }
+
+    fcntl(fdOut, F_SETFL, fcntl(fdOut, F_GETFL) | O_NONBLOCK);
+    fcntl(fdErr, F_SETFL, fcntl(fdErr, F_GETFL) | O_NONBLOCK);
+    worker->fdOut = fdOut;
+    worker->fdErr = fdErr;
+    worker->busy = true;
+    worker->exited = false;
+    return (int)handle;
+}
+
+void WorkerProcess(void)
+{
+    uint i;
+    for (i = 0; i < workerCount; i++)
+    {
+        Worker *worker = &workers[i];
+        receive(worker);
+        handleMessages(worker);
+        if (worker->exited)
+        {
+            writeOutput(worker, &worker->fdOut, &worker->outPos, worker->outEnd);
+            writeOutput(worker, &worker->fdErr, &worker->errPos, worker->errEnd);
+        }
+    }
+}
+
+bool WorkerReap(int handle, int *status, struct rusage *usage)
+{
+    Worker *worker = &workers[handle];
+
+    assert(worker->busy);
+    if (!worker->exited || worker->fdOut >= 0 || worker->fdErr >= 0)
+    {
+        return false;
+    }
+    *status = worker->status;
+    *usage = worker->usage;
+    BVSetSize(&worker->result, 0);
+    worker->busy = false;
+    worker->exited = false;
+    return true;
+}
+
+void WorkerSignal(int handle, int sig)
+{
+    Worker *worker = &workers[handle];
+
+    if (!worker->busy || worker->exited)
+    {
+        return;
+    }
+    beginMessage(&message, MESSAGE_KILL);
+    addNumber(&message, (ulong)sig);
+    if (!sendMessage(worker->fd, &message))
+    {
+        failConnection(worker);
+    }
+}
+
+
+/* Returns false at end of file or on errors. */
+static bool readAll(int fd, byte *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t readSize = read(fd, data, size);
+        if (readSize <= 0)
+        {
+            if (readSize < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += readSize;
+        size -= (size_t)readSize;
+    }
+    return true;
+}
+
+/* Reads a message into buffer, without the header. Returns false if the connection is lost. */
+static bool readMessage(int fd, bytevector *buffer, byte *type)
+{
+    byte header[HEADER_SIZE];
+    Reader reader;
+    size_t size;
+
+    if (!readAll(fd, header, HEADER_SIZE))
+    {
+        return false;
+    }
+    *type = header[0];
+    initReader(&reader, header + 1, NUMBER_SIZE);
+    size = (size_t)readNumber(&reader);
+    BVSetSize(buffer, 0);
+    return readAll(fd, BVGetAppendPointer(buffer, size), size);
+}
+
+/* Returns an unlinked temporary file, or -1 on errors. */
+static int createTemporaryFile(void)
+{
+    const char *tmp = getenv("TMPDIR");
+    char *path;
+    int fd;
+
+    tmp = tmp && *tmp ? tmp : "/tmp";
+    path = (char*)malloc(strlen(tmp) + 20);
+    sprintf(path, "%s/don-worker-XXXXXX", tmp);
+    fd = mkstemp(path);
+    if (fd >= 0)
+    {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    free(path);
+    return fd;
+}
+
+/* Reads the whole file into buffer, after what is in it already. */
+static bool readFD(int fd, bytevector *buffer)
+{
+    struct stat s;
+    if (fstat(fd, &s) || lseek(fd, 0, SEEK_SET))
+    {
+        return false;
+    }
+    return readAll(fd, BVGetAppendPointer(buffer, (size_t)s.st_size), (size_t)s.st_size);
+}
+
+static void addFileData(int fd)
+{
+    struct stat s;
+    if (fstat(fd, &s))
+    {
+        FailErrno(false);
+    }
+    addNumber(&message, (ulong)s.st_size);
+    if (!readFD(fd, &message))
+    {
+        FailErrno(false);
+    }
+}
+
+static bool fileMatches(const char *path, const byte *digest)
+{
+    byte hash[DIGEST_SIZE];
+    bytevector data;
+    bool matches = false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat s;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+    BVInit(&data, 0);
+    if (!fstat(fd, &s) && S_ISREG(s.st_mode) && readFD(fd, &data))
+    {
+        Hash(BVGetPointer(&data, 0), BVSize(&data), hash);
+        matches = !memcmp(hash, digest, DIGEST_SIZE);
+    }
+    BVDispose(&data);
+    close(fd);
+    return matches;
+}
+
+/* Writes an input the worker didn't have, creating its directory if needed. */
+static void writeInput(const char *path, const byte *data, size_t size)
+{
+    char *directory = (char*)malloc(strlen(path) + 1);
+    char *slash;
+    int fd;
+    ssize_t writeSize = 0;
+
+    strcpy(directory, path);
+    for (slash = strchr(directory + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = 0;
+        mkdir(directory, 0777);
+        *slash = '/';
+    }
+    free(directory);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    while (fd >= 0 && size)
+    {
+        writeSize = write(fd, data, size);
+        if (writeSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        data += writeSize;
+        size -= (size_t)writeSize;
+    }
+    if (fd < 0 || writeSize < 0)
+    {
+        fprintf(stderr, "don: Error writing %s: %s\n", path, strerror(errno));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+        /* A truncated file would be taken for the input the next time. */
+        if (writeSize < 0)
+        {
+            unlink(path);
+        }
+    }
+}
+
+/*
+  Asks the client for the inputs that differ from the files the worker has, and writes them.
+  Returns false if the connection is lost. A kill received meanwhile is stored in killSignal.
+*/
+static bool updateInputs(int fd, const char **inputs, const byte **digests, size_t count,
+                         int *killSignal)
+{
+    bytevector reply;
+    Reader reader;
+    size_t missing = 0;
+    size_t contentCount;
+    size_t index;
+    size_t size;
+    const byte *data;
+    byte type;
+    size_t i;
+
+    beginMessage(&message, MESSAGE_MISSING);
+    addNumber(&message, 0);
+    for (i = 0; i < count; i++)
+    {
+        if (!fileMatches(inputs[i], digests[i]))
+        {
+            addNumber(&message, i);
+            missing++;
+        }
+    }
+    if (!missing)
+    {
+        return true;
+    }
+    setNumber(&message, HEADER_SIZE, missing);
+    if (!sendMessage(fd, &message))
+    {
+        return false;
+    }
+    BVInit(&reply, 4096);
+    for (;;)
+    {
+        if (!readMessage(fd, &reply, &type))
+        {
+            BVDispose(&reply);
+            return false;
+        }
+        initReader(&reader, BVGetPointer(&reply, 0), BVSize(&reply));
+        if (type == MESSAGE_CONTENTS)
+        {
+            break;
+        }
+        if (type == MESSAGE_KILL)
+        {
+            *killSignal = (int)readNumber(&reader);
+        }
+    }
+    for (contentCount = (size_t)readNumber(&reader); contentCount--;)
+    {
+        index = (size_t)readNumber(&reader);
+        data = readData(&reader, &size);
+        if (reader.invalid || index >= count)
+        {
+            break;
+        }
+        writeInput(inputs[index], data, size);
+    }
+    BVDispose(&reply);
+    return !reader.invalid;
+}
+
+static int startProcess(const char *cwd, const char *executable, char **argv, char **envp,
+                        int fdIn, int fdOut, int fdErr)
+{
+    pid_t pid = fork();
+    if (!pid)
+    {
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+        if (dup2(fdIn, STDIN_FILENO) < 0 || dup2(fdOut, STDOUT_FILENO) < 0 ||
+            dup2(fdErr, STDERR_FILENO) < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        if (chdir(cwd))
+        {
+            fprintf(stderr, "don: Error changing directory to %s: %s\n", cwd, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        execve(executable, argv, envp);
+        fprintf(stderr, "don: Error starting %s: %s\n", executable, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    if (pid > 0)
+    {
+        /* Also set here, so that it can be killed before it has set it itself. */
+        setpgid(pid, pid);
+    }
+    return pid;
+}
+
+static int watchProcess(int pid)
+{
+#if HAVE_PIDFD && defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+static ulong timevalMicros(const struct timeval *time)
+{
+    return (ulong)time->tv_sec * 1000000 + (ulong)time->tv_usec;
+}
+
+/*
+  Waits for the process to exit, passing on kills from the client. Returns false if the
+  connection is lost, in which case the process is killed.
+*/
+static bool waitProcess(int fd, int pid, int *status, struct rusage *usage)
+{
+    struct pollfd fds[2];
+    bytevector kill;
+    Reader reader;
+    byte type;
+    int pidFD = watchProcess(pid);
+    bool connected = true;
+
+    BVInit(&kill, NUMBER_SIZE);
+    while (wait4(pid, status, WNOHANG, usage) != pid)
+    {
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = pidFD;
+        fds[1].events = POLLIN;
+        if (poll(fds, pidFD >= 0 ? 2 : 1, pidFD >= 0 ? -1 : REAP_INTERVAL) <= 0 ||
+            !fds[0].revents || !connected)
+        {
+            continue;
+        }
+        if (!readMessage(fd, &kill, &type))
+        {
+            killpg(pid, SIGKILL);
+            connected = false;
+            fds[0].fd = -1;
+            continue;
+        }
+        initReader(&reader, BVGetPointer(&kill, 0), BVSize(&kill));
+        if (type == MESSAGE_KILL)
+        {
+            killpg(pid, (int)readNumber(&reader));
+        }
+    }
+    if (pidFD >= 0)
+    {
+        close(pidFD);
+    }
+    BVDispose(&kill);
+    return connected;
+}
+
+/* Reads a count of items that take at least NUMBER_SIZE bytes each. */
+static size_t readCount(Reader *reader)
+{
+    size_t count = (size_t)readNumber(reader);
+    if (count > reader->size / NUMBER_SIZE)
+    {
+        reader->invalid = true;
+        return 0;
+    }
+    return count;
+}
+
+/* Runs the process of a request, and replies with its result. Returns false if the connection
+   is lost. */
+static bool runRequest(int fd, const bytevector *request)
+{
+    Reader reader;
+    const char *cwd;
+    const char *executable;
+    char **argv;
+    char **envp;
+    const char **inputs;
+    const byte **digests;
+    const char **outputs;
+    const byte *stdinData;
+    size_t stdinSize;
+    size_t argc;
+    size_t envc;
+    size_t inputCount;
+    size_t outputCount;
+    size_t i;
+    int killSignal = 0;
+    int fdIn;
+    int fdOut;
+    int fdErr;
+    int pid;
+    int status;
+    struct rusage usage;
+    bool connected;
+
+    initReader(&reader, BVGetPointer(request, 0), BVSize(request));
+    cwd = readString(&reader);
+    executable = readString(&reader);
+    argc = readCount(&reader);
+    argv = (char**)malloc((argc + 1) * sizeof(char*));
+    for (i = 0; i < argc; i++)
+    {
+        argv[i] = (char*)readString(&reader);
+    }
+    argv[argc] = null;
+    envc = readCount(&reader);
+    envp = (char**)malloc((envc + 1) * sizeof(char*));
+    for (i = 0; i < envc; i++)
+    {
+        envp[i] = (char*)readString(&reader);
+    }
+    envp[envc] = null;
+    stdinData = readData(&reader, &stdinSize);
+    inputCount = readCount(&reader);
+    inputs = (const char**)malloc((inputCount + 1) * sizeof(char*));
+    digests = (const byte**)malloc((inputCount + 1) * sizeof(byte*));
+    for (i = 0; i < inputCount; i++)
+    {
+        inputs[i] = readString(&reader);
+        digests[i] = reader.data;
+        if (reader.size < DIGEST_SIZE)
+        {
+            reader.invalid = true;
+            break;
+        }
+        reader.data += DIGEST_SIZE;
+        reader.size -= DIGEST_SIZE;
+    }
+    outputCount = readCount(&reader);
+    outputs = (const char**)malloc((outputCount + 1) * sizeof(char*));
+    for (i = 0; i < outputCount; i++)
+    {
+        outputs[i] = readString(&reader);
+    }
+
+    connected = !reader.invalid && argc &&
+        updateInputs(fd, inputs, digests, inputCount, &killSignal);
+    free(inputs);
+    free(digests);
+    if (!connected)
+    {
+        free(argv);
+        free(envp);
+        free(outputs);
+        return false;
+    }
+
+    fdIn = createTemporaryFile();
+    fdOut = createTemporaryFile();
+    fdErr = createTemporaryFile();
+    if (fdIn < 0 || fdOut < 0 || fdErr < 0 ||
+        (stdinSize && write(fdIn, stdinData, stdinSize) != (ssize_t)stdinSize) ||
+        lseek(fdIn, 0, SEEK_SET))
+    {
+        FailErrno(false);
+    }
+    pid = startProcess(cwd, executable, argv, envp, fdIn, fdOut, fdErr);
+    free(argv);
+    free(envp);
+    close(fdIn);
+    if (pid < 0)
+    {
+        FailErrno(false);
+    }
+    if (killSignal)
+    {
+        killpg(pid, killSignal);
+    }
+    connected = waitProcess(fd, pid, &status, &usage);
+
+    if (connected)
+    {
+        beginMessage(&message, MESSAGE_DONE);
+        addNumber(&message, (ulong)status);
+        addNumber(&message, timevalMicros(&usage.ru_utime));
+        addNumber(&message, timevalMicros(&usage.ru_stime));
+        addNumber(&message, (ulong)usage.ru_maxrss);
+        addNumber(&message, (ulong)usage.ru_inblock);
+        addNumber(&message, (ulong)usage.ru_oublock);
+        addNumber(&message, (ulong)usage.ru_nvcsw);
+        addNumber(&message, (ulong)usage.ru_nivcsw);
+        addFileData(fdOut);
+        addFileData(fdErr);
+        addNumber(&message, outputCount);
+        for (i = 0; i < outputCount; i++)
+        {
+            int outputFD = open(outputs[i], O_RDONLY | O_CLOEXEC);
+            struct stat s;
+            if (outputFD >= 0 && !fstat(outputFD, &s) && S_ISREG(s.st_mode))
+            {
+                addNumber(&message, 1);
+                addFileData(outputFD);
+            }
+            else
+            {
+                addNumber(&message, 0);
+            }
+            if (outputFD >= 0)
+            {
+                close(outputFD);
+            }
+        }
+        connected = sendMessage(fd, &message);
+    }
+    close(fdOut);
+    close(fdErr);
+    free(outputs);
+    return connected;
+}
+
+void WorkerServe(const char *address)
+{
+    bytevector request;
+    byte type;
+    int listenFD = openSocket(address, true);
+    int fd;
+
+    if (listenFD < 0)
+    {
+        FailIO("Error listening on", address);
+    }
+    BVInit(&message, 4096);
+    BVInit(&request, 4096);
+    for (;;)
+    {
+        fd = accept4(listenFD, null, null, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            FailErrno(false);
+        }
+        while (readMessage(fd, &request, &type))
+        {
+            /* A kill for a process that has already exited is ignored. */
+            if (type == MESSAGE_REQUEST && !runRequest(fd, &request))
+            {
+                break;
+            }
+        }
+        close(fd);
+    }
+}
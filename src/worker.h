@@ -0,0 +1,61 @@
+struct rusage;
+
+/*
+  Workers are don processes started with --worker=ADDRESS that run processes for other don
+  processes, which connect to them with --workers=ADDRESS,... ADDRESS is unix:PATH for a Unix
+  socket, or HOST:PORT for TCP. HOST is an IPv4 or IPv6 address, as host names aren't resolved. An
+  empty HOST is the loopback address. Connections aren't authenticated, and a worker runs any
+  command and writes any file it is asked to, so a worker only listens on another interface if its
+  address is given explicitly, e.g. 0.0.0.0:PORT. Each worker runs one process at a time, for one
+  connection at a time, so the number of workers is the number of processes that can run on them at
+  once.
+
+  A request carries the working directory, executable, arguments, environment and stdin of the
+  process, and the digests of the files it accesses. The worker asks for the contents of the files
+  it doesn't have with the same digest, and writes them before starting the process. When the
+  process has exited, the worker replies with its status, usage, stdout and stderr, and the
+  contents of the files it may have modified, which are written back if they differ.
+
+  Output is returned once the process has exited, rather than while it runs. A process that would
+  inherit stdin gets empty stdin instead.
+*/
+
+/*
+  Connects to the workers in addresses, which is a comma separated list. Fails if any of them
+  can't be connected to. PipeInit must have been called.
+*/
+nonnull void WorkerInit(const char *addresses);
+void WorkerDispose(void);
+
+/* Returns the number of workers connected to by WorkerInit. */
+uint WorkerCount(void);
+
+/* Returns true if a worker is free to run a process. */
+bool WorkerIdle(void);
+
+/*
+  Starts executable on a free worker. accessedFiles and modifiedFiles are lists of files. fdOut and
+  fdErr get the output of the process, and are closed once it has been written. Returns a handle for
+  the other functions.
+*/
+nonnull int WorkerStart(const char *executable, char *const argv[], const char *const envp[],
+                        const char *stdinData, size_t stdinSize, int fdOut, int fdErr,
+                        vref accessedFiles, vref modifiedFiles);
+
+/*
+  Handles the messages received from workers and writes the output of finished processes. Should
+  be called whenever PipeProcess returns.
+*/
+void WorkerProcess(void);
+
+/*
+  Returns true if the process has exited and its output has been written, after setting status and
+  usage like wait4. The worker is then free again.
+*/
+nonnull bool WorkerReap(int handle, int *status, struct rusage *usage);
+
+/* Sends sig to the process group of the process. */
+void WorkerSignal(int handle, int sig);
+
+/* Runs processes for the don processes connecting to address. Never returns. */
+nonnull noreturn void WorkerServe(const char *address);